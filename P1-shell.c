@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // pipe2, F_SETPIPE_SZ, splice, tee
 #include <stdio.h>
 #include <signal.h>
 #include <stdlib.h>
@@ -7,208 +8,1546 @@
 #include <string.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <spawn.h>
+#include <errno.h>
+#include <termios.h>
+#include <limits.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
 
-void handle_sigstp(int signal) {} // Ctrl+Z -> ignore
+extern char **environ;
+
+int pipesize = 0; // F_SETPIPE_SZ for pipeline pipes, 0: system default
+
+#define MAXJOBS 32      // background and stopped jobs at once
+#define HASHSIZE 64     // buckets of the command hash table
+#define MAXEVENTS 1024  // child status changes not yet seen by the shell
+#define MAXSTAGES 20    // commands in one pipeline
+#define INPUTSIZE 65536 // bytes read from a script at once
+#define MAXSLOTS 64     // parallel -j limit
+
+/* a pipeline started by the shell, all stages in one process group */
+struct job
+{
+    int id;                // job number shown by jobs, 0: free slot
+    pid_t pgid;            // process group of the stages
+    pid_t pids[MAXSTAGES]; // stages, 0 once reaped
+    int npids;
+    int alive;             // stages not reaped yet
+    int stopped;           // 1 while stopped by Ctrl+Z / SIGSTOP
+    int status;            // wait status of the last stage
+    char cmd[80];          // command line, for jobs
+    struct rusage ru;      // resources of the stages that exited
+    double start;          // now() when started
+    int timed;             // report the resources when it finishes in the background
+};
+struct job jobs[MAXJOBS];
+int nextjobid = 1;
+
+pid_t fgpgid = 0;    // process group of the foreground job, 0: the shell is in front
+pid_t shellpgid;     // the shell's own process group
+int interactive = 0; // stdin is the shell's terminal: hand it to foreground jobs
+int laststatus = 0;  // exit status of the last command, for &&, || and exit
+volatile sig_atomic_t interrupted = 0; // Ctrl+C reached the shell, for parallel
+
+/* status changes reaped by the SIGCHLD handler, applied to jobs by the shell */
+struct childevent
+{
+    pid_t pid;
+    int status;
+    struct rusage ru; // from wait4, for time
+};
+struct childevent events[MAXEVENTS];
+volatile sig_atomic_t eventhead = 0; // written by the handler
+int eventtail = 0;                   // read by the shell with SIGCHLD blocked
+
+/* children of the running parallel builtin: not jobs, their exit status is
+ * stored through status once drainevents() sees them go, their resources are
+ * added to cmdusage */
+struct slot
+{
+    pid_t pid; // 0: free
+    int *status;
+};
+struct slot slots[MAXSLOTS];
+
+int timeall = 0;          // timing on: report every command
+int timecmd = 0;          // the running command is prefixed by time
+int timelog = -1;         // timing log file: a record for every command
+struct rusage cmdusage;   // children reaped for the running foreground command
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* adds the resources in ru to sum; maxrss is that of the largest child */
+void addusage(struct rusage *sum, const struct rusage *ru)
+{
+    timeradd(&sum->ru_utime, &ru->ru_utime, &sum->ru_utime);
+    timeradd(&sum->ru_stime, &ru->ru_stime, &sum->ru_stime);
+    if (ru->ru_maxrss > sum->ru_maxrss)
+        sum->ru_maxrss = ru->ru_maxrss;
+    sum->ru_minflt += ru->ru_minflt;
+    sum->ru_majflt += ru->ru_majflt;
+    sum->ru_nvcsw += ru->ru_nvcsw;
+    sum->ru_nivcsw += ru->ru_nivcsw;
+}
+
+/* resources of a finished command: a line on stderr if show is set, and a tab
+ * separated record in the timing log (end time, wall, user and system seconds,
+ * max RSS in KB, voluntary and involuntary context switches, minor and major
+ * page faults, exit status, command) */
+void report(const char *cmd, double start, const struct rusage *ru, int status, int show)
+{
+    double wall = now() - start;
+    double user = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+    double sys = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+
+    fflush(stdout); // keep the report after the command's own output
+    if (show)
+        fprintf(stderr, "real %.3fs  user %.3fs  sys %.3fs  maxrss %ldKB  ctxsw %ld/%ld  faults %ld/%ld\n",
+                wall, user, sys, ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt, ru->ru_majflt);
+    if (timelog != -1)
+    {
+        struct timespec end;
+        clock_gettime(CLOCK_REALTIME, &end);
+        dprintf(timelog, "%ld.%03ld\t%.6f\t%.6f\t%.6f\t%ld\t%ld\t%ld\t%ld\t%ld\t%d\t%s\n",
+                (long)end.tv_sec, end.tv_nsec / 1000000, wall, user, sys, ru->ru_maxrss,
+                ru->ru_nvcsw, ru->ru_nivcsw, ru->ru_minflt, ru->ru_majflt, status, cmd);
+    }
+}
+
+int exitcode(int status)
+{
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// Ctrl+C / Ctrl+Z go to the foreground job only, never to the shell
+void handle_sigstp(int signal)
+{
+    if (fgpgid != 0)
+        kill(-fgpgid, SIGTSTP);
+}
 void handle_sigint(int signal)
 {
-    kill(0, SIGCHLD);
+    interrupted = 1;
+    if (fgpgid != 0)
+        kill(-fgpgid, SIGINT);
+}
+
+// children are reaped as soon as they change state, so no zombies pile up
+void handle_sigchld(int signal)
+{
+    int saved = errno, status;
+    struct rusage ru;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0)
+    {
+        events[eventhead % MAXEVENTS] = (struct childevent){pid, status, ru};
+        eventhead++;
+    }
+    errno = saved;
+}
+
+void blockchld(sigset_t *old)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, old);
 }
 
-int getcmd(char *prompt, char *args[], int *background)
+void freejob(struct job *j)
 {
-    int length, i = 0;
-    char *token, *loc;
-    char *line = NULL;
-    size_t linecap = 0;
+    memset(j, 0, sizeof(*j));
+}
+
+/* applies the reaped status changes to the job table, SIGCHLD must be blocked.
+ * finished background jobs are reported and their slot is freed */
+void drainevents()
+{
+    while (eventtail != eventhead)
+    {
+        struct childevent *e = &events[eventtail % MAXEVENTS];
+        eventtail++;
+
+        for (int s = 0; s < MAXSLOTS; s++)
+        {
+            if (slots[s].pid == e->pid && !WIFSTOPPED(e->status) && !WIFCONTINUED(e->status))
+            {
+                *slots[s].status = e->status;
+                slots[s].pid = 0;
+                addusage(&cmdusage, &e->ru);
+            }
+        }
+
+        for (int i = 0; i < MAXJOBS; i++)
+        {
+            struct job *j = &jobs[i];
+            for (int k = 0; j->id != 0 && k < j->npids; k++)
+            {
+                if (j->pids[k] != e->pid)
+                    continue;
+                if (WIFSTOPPED(e->status))
+                    j->stopped = 1;
+                else if (WIFCONTINUED(e->status))
+                    j->stopped = 0;
+                else
+                {
+                    j->pids[k] = 0;
+                    j->alive--;
+                    addusage(&j->ru, &e->ru);
+                    if (k == j->npids - 1)
+                        j->status = e->status;
+                    if (j->alive == 0 && j->pgid != fgpgid)
+                    {
+                        printf("[%d] Done\t%s\n", j->id, j->cmd);
+                        report(j->cmd, j->start, &j->ru, exitcode(j->status), j->timed);
+                        freejob(j);
+                    }
+                }
+            }
+        }
+    }
+}
 
-    signal(SIGTSTP, handle_sigstp); // Ctrl+Z
-    signal(SIGINT, handle_sigint);  // Ctrl+C
+/* finds a job from "%n", "n" or (NULL) the most recent one */
+struct job *findjob(char *spec)
+{
+    struct job *found = NULL;
+    int id = spec == NULL ? 0 : atoi(spec[0] == '%' ? spec + 1 : spec);
+    for (int i = 0; i < MAXJOBS; i++)
+    {
+        if (jobs[i].id == 0)
+            continue;
+        if (id == 0 ? (found == NULL || jobs[i].id > found->id) : jobs[i].id == id)
+            found = &jobs[i];
+    }
+    if (found == NULL)
+    {
+        printf("no such job\n");
+        laststatus = 1;
+    }
+    return found;
+}
 
-    printf("%s", prompt);
-    length = getline(&line, &linecap, stdin);
+/* puts a job in the foreground and waits until it finishes or stops */
+void waitjob(struct job *j)
+{
+    sigset_t old;
+    blockchld(&old);
+    fgpgid = j->pgid;
+    if (interactive)
+        tcsetpgrp(0, j->pgid);
 
-    if (length <= 0)
+    drainevents();
+    while (j->alive > 0 && !j->stopped)
     {
-        exit(-1);
+        sigsuspend(&old); // returns once the SIGCHLD handler ran
+        drainevents();
     }
 
-    // Check if background is specified..
-    if ((loc = index(line, '&')) != NULL)
+    if (interactive)
+        tcsetpgrp(0, shellpgid);
+    fgpgid = 0;
+    if (j->stopped)
     {
-        *background = 1; // &
-        *loc = ' ';
+        printf("\n[%d] Stopped\t%s\n", j->id, j->cmd);
+        laststatus = 128 + SIGTSTP;
     }
     else
-        *background = 0; // no &
+    {
+        laststatus = exitcode(j->status);
+        addusage(&cmdusage, &j->ru);
+        freejob(j);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
 
-    while ((token = strsep(&line, " \t\n")) != NULL)
+/* command hash table: command name => absolute path found in PATH */
+struct hashentry
+{
+    char *name;
+    char *path;
+    int hits;
+    struct hashentry *next;
+};
+struct hashentry *hashtable[HASHSIZE];
+char *hashedpath = NULL; // PATH the table was filled from
+
+unsigned int hashname(const char *name)
+{
+    unsigned int h = 5381;
+    for (; *name; name++)
+        h = h * 33 + (unsigned char)*name;
+    return h % HASHSIZE;
+}
+
+/* hash -r: forget every command */
+void hashclear()
+{
+    for (int i = 0; i < HASHSIZE; i++)
     {
-        for (int j = 0; j < strlen(token); j++)
-            if (token[j] <= 32)
-                token[j] = '\0';
-        if (strlen(token) > 0)
-            args[i++] = token;
+        while (hashtable[i] != NULL)
+        {
+            struct hashentry *e = hashtable[i];
+            hashtable[i] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
     }
+}
 
-    return i;
+void hashforget(const char *name)
+{
+    for (struct hashentry **link = &hashtable[hashname(name)]; *link != NULL; link = &(*link)->next)
+    {
+        if (strcmp((*link)->name, name) == 0)
+        {
+            struct hashentry *e = *link;
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+    }
 }
 
-int main(void)
+/* returns the path to exec for name: names with a '/' are used as they are,
+ * others come from the hash table, or from a PATH search whose result is
+ * remembered. NULL if the command is not found */
+char *resolve(const char *name, int *cached)
 {
-    char buf[BUFSIZ];
-    char *args[20] = {NULL};
-    int bg;
+    *cached = 0;
+    if (strchr(name, '/') != NULL)
+        return (char *)name;
 
-    int *jobs = NULL;
-    jobs = (int *)malloc(sizeof(int));
+    // a new PATH invalidates the whole table
+    const char *path = getenv("PATH");
+    if (path == NULL)
+        path = "/usr/local/bin:/usr/bin:/bin";
+    if (hashedpath == NULL || strcmp(hashedpath, path) != 0)
+    {
+        hashclear();
+        free(hashedpath);
+        hashedpath = strdup(path);
+    }
 
-    while (1)
+    unsigned int h = hashname(name);
+    for (struct hashentry *e = hashtable[h]; e != NULL; e = e->next)
+    {
+        if (strcmp(e->name, name) == 0)
+        {
+            e->hits++;
+            *cached = 1;
+            return e->path;
+        }
+    }
+
+    // miss: probe each PATH directory once
+    char candidate[PATH_MAX];
+    for (const char *dir = path; dir != NULL; dir = strchr(dir, ':') != NULL ? strchr(dir, ':') + 1 : NULL)
     {
-        bg = 0;
-        int cnt = getcmd("\n>> ", args, &bg);
-        args[cnt] = NULL;
+        int len = strchr(dir, ':') != NULL ? strchr(dir, ':') - dir : (int)strlen(dir);
+        // an empty entry is the current directory
+        snprintf(candidate, sizeof(candidate), "%.*s/%s", len > 0 ? len : 1, len > 0 ? dir : ".", name);
 
-        int fd[2];
-        pipe(fd);
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0)
+        {
+            struct hashentry *e = (struct hashentry *)malloc(sizeof(struct hashentry));
+            e->name = strdup(name);
+            e->path = strdup(candidate);
+            e->hits = 1;
+            e->next = hashtable[h];
+            hashtable[h] = e;
+            return e->path;
+        }
+    }
+    return NULL;
+}
 
-        int pid = fork();
-        if (pid == 0)
-        { // child
+void parallel(char *args[]);
 
-            if (strcmp(args[0], "exit") == 0)
+/* the signal named by s: a number, or a name such as TERM or SIGTERM,
+ * -1 if s is neither */
+int signum(const char *s)
+{
+    static const struct
+    {
+        const char *name;
+        int sig;
+    } names[] = {{"HUP", SIGHUP},   {"INT", SIGINT},   {"QUIT", SIGQUIT}, {"ABRT", SIGABRT},
+                 {"KILL", SIGKILL}, {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE},
+                 {"ALRM", SIGALRM}, {"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT},
+                 {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU}};
+    if (s[0] >= '0' && s[0] <= '9')
+    {
+        char *end;
+        long n = strtol(s, &end, 10);
+        return *end == '\0' && n < NSIG ? (int)n : -1;
+    }
+    if (strncmp(s, "SIG", 3) == 0)
+        s += 3;
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (strcmp(s, names[i].name) == 0)
+            return names[i].sig;
+    }
+    return -1;
+}
+
+/* runs exit, cd, jobs, fg, bg, wait, kill, hash, parallel, timing and pipesize
+ * in the shell itself, returns 1 if args was a builtin */
+int builtin(char *args[])
+{
+    if (strcmp(args[0], "exit") == 0)
+    {
+        exit(args[1] != NULL ? atoi(args[1]) : laststatus);
+    }
+    laststatus = 0;
+    if (strcmp(args[0], "cd") == 0)
+    {
+        if (chdir(args[1] != NULL ? args[1] : getenv("HOME")) != 0)
+        {
+            perror("cd");
+            laststatus = 1;
+        }
+        return 1;
+    }
+    if (strcmp(args[0], "jobs") == 0)
+    {
+        sigset_t old;
+        blockchld(&old);
+        drainevents();
+        for (int i = 0; i < MAXJOBS; i++)
+        {
+            if (jobs[i].id != 0)
+                printf("[%d] %d %s\t%s\n", jobs[i].id, jobs[i].pgid,
+                       jobs[i].stopped ? "Stopped" : "Running", jobs[i].cmd);
+        }
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return 1;
+    }
+    if (strcmp(args[0], "fg") == 0 || strcmp(args[0], "bg") == 0)
+    {
+        // fg [%n] / bg [%n]: resume a job in the foreground / background
+        struct job *j = findjob(args[1]);
+        if (j == NULL)
+            return 1;
+        j->stopped = 0;
+        kill(-j->pgid, SIGCONT);
+        printf("%s\n", j->cmd);
+        if (args[0][0] == 'f')
+            waitjob(j);
+        return 1;
+    }
+    if (strcmp(args[0], "wait") == 0)
+    {
+        // wait [%n]: wait for one job, or for every running job
+        sigset_t old;
+        blockchld(&old);
+        struct job *j = args[1] != NULL ? findjob(args[1]) : NULL;
+        while (args[1] == NULL || j != NULL)
+        {
+            drainevents();
+            int running = 0;
+            for (int i = 0; i < MAXJOBS; i++)
             {
-                kill(0, SIGTERM);
+                if (jobs[i].id != 0 && !jobs[i].stopped && (j == NULL || &jobs[i] == j))
+                    running = 1;
             }
-
-            char *cmd1[10] = {NULL};
-            char *cmd2[10] = {NULL};
-            int i = 0;
-            for (i; i < cnt; i++)
+            if (!running || (j != NULL && j->id == 0))
+                break;
+            sigsuspend(&old);
+        }
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return 1;
+    }
+    if (strcmp(args[0], "kill") == 0)
+    {
+        // kill [-SIGNAL] %n|pid
+        int sig = SIGTERM, i = 1;
+        if (args[1] != NULL && args[1][0] == '-')
+        {
+            sig = signum(args[1] + 1);
+            if (sig == -1)
             {
-                if (strcmp(args[i], "|") == 0 || strcmp(args[i], ">") == 0 || args[i] == NULL)
-                    break;
-                else
-                    cmd1[i] = args[i];
+                printf("kill: %s: invalid signal\n", args[1] + 1);
+                laststatus = 2;
+                return 1;
+            }
+            i = 2;
+        }
+        for (; args[i] != NULL; i++)
+        {
+            pid_t target = atoi(args[i]);
+            if (args[i][0] == '%')
+            {
+                struct job *j = findjob(args[i]);
+                if (j == NULL)
+                    continue;
+                target = -j->pgid;
+            }
+            if (kill(target, sig) == -1)
+            {
+                perror("kill");
+                laststatus = 1;
+            }
+        }
+        return 1;
+    }
+    if (strcmp(args[0], "hash") == 0)
+    {
+        // hash: list remembered commands, hash -r: forget them, hash name...: look up now
+        if (args[1] != NULL && strcmp(args[1], "-r") == 0)
+        {
+            hashclear();
+            return 1;
+        }
+        for (int i = 1; args[i] != NULL; i++)
+        {
+            int cached;
+            if (resolve(args[i], &cached) == NULL)
+                printf("hash: %s: not found\n", args[i]);
+        }
+        if (args[1] == NULL)
+        {
+            printf("hits\tcommand\n");
+            for (int i = 0; i < HASHSIZE; i++)
+            {
+                for (struct hashentry *e = hashtable[i]; e != NULL; e = e->next)
+                    printf("%4d\t%s\n", e->hits, e->path);
             }
-            char *op = args[i];
-            cmd1[i + 1] = NULL;
+        }
+        return 1;
+    }
+    if (strcmp(args[0], "parallel") == 0)
+    {
+        parallel(args);
+        return 1;
+    }
+    if (strcmp(args[0], "timing") == 0)
+    {
+        // timing on|off: report every command, timing log [file]: record them in file
+        if (args[1] != NULL && strcmp(args[1], "log") == 0)
+        {
+            if (timelog != -1)
+                close(timelog);
+            timelog = -1;
+            if (args[2] != NULL && (timelog = open(args[2], O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) == -1)
+                perror(args[2]);
+            if (timelog != -1 && lseek(timelog, 0, SEEK_END) == 0)
+                dprintf(timelog, "end\twall\tuser\tsys\tmaxrss_kb\tnvcsw\tnivcsw\tminflt\tmajflt\tstatus\tcommand\n");
+        }
+        else if (args[1] != NULL)
+            timeall = strcmp(args[1], "on") == 0;
+        printf("timing %s, log %s\n", timeall ? "on" : "off", timelog != -1 ? "on" : "off");
+        return 1;
+    }
+    if (strcmp(args[0], "pipesize") == 0)
+    {
+        // pipesize [bytes]: pipe buffer for later pipelines, 0 for the default
+        if (args[1] != NULL)
+            pipesize = atoi(args[1]);
+        printf("pipe buffer size: %d\n", pipesize);
+        return 1;
+    }
+    return 0;
+}
+
+/* operators, told apart from quoted words by address */
+char OP_SEQ[] = ";", OP_BG[] = "&", OP_AND[] = "&&", OP_OR[] = "||";
+char OP_PIPE[] = "|", OP_IN[] = "<", OP_OUT[] = ">", OP_APPEND[] = ">>", OP_ERR[] = "2>";
+
+/* a redirection of one command: fd is opened on path with flags */
+struct redirect
+{
+    int fd;
+    char *path;
+    int flags;
+};
+
+/* removes "< f", "> f", ">> f" and "2> f" from argv into r[],
+ * returns the number of redirections, -1 on a syntax error */
+int redirections(char *argv[], struct redirect r[])
+{
+    int n = 0, j = 0;
+    for (int i = 0; argv[i] != NULL; i++)
+    {
+        struct redirect next;
+        if (argv[i] == OP_IN)
+            next = (struct redirect){0, NULL, O_RDONLY};
+        else if (argv[i] == OP_OUT)
+            next = (struct redirect){1, NULL, O_WRONLY | O_CREAT | O_TRUNC};
+        else if (argv[i] == OP_APPEND)
+            next = (struct redirect){1, NULL, O_WRONLY | O_CREAT | O_APPEND};
+        else if (argv[i] == OP_ERR)
+            next = (struct redirect){2, NULL, O_WRONLY | O_CREAT | O_TRUNC};
+        else
+        {
+            argv[j++] = argv[i];
+            continue;
+        }
+        if (argv[i + 1] == NULL || n == 4)
+        {
+            printf("missing file after %s\n", argv[i]);
+            return -1;
+        }
+        next.path = argv[++i];
+        r[n++] = next;
+    }
+    argv[j] = NULL;
+    return n;
+}
+
+/* starts argv without forking the shell: posix_spawn uses vfork semantics,
+ * so the child borrows the shell's address space until it execs.
+ * in/out replace stdin/stdout when not -1, then the redirections are opened
+ * directly on the child's descriptors. Every other descriptor the shell
+ * opens for commands is close-on-exec, so children only see their own ends.
+ * the child joins process group pgid (0: a new group led by itself) */
+pid_t launch(char *argv[], int in, int out, struct redirect r[], int nr, pid_t pgid)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask, defaults;
+    pid_t pid;
+
+    // the job's group, signals the shell catches or ignores back to default
+    sigemptyset(&mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    sigaddset(&defaults, SIGCHLD);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+
+    posix_spawn_file_actions_init(&actions);
+    if (in != -1)
+        posix_spawn_file_actions_adddup2(&actions, in, 0);
+    if (out != -1)
+        posix_spawn_file_actions_adddup2(&actions, out, 1);
+    for (int i = 0; i < nr; i++)
+        posix_spawn_file_actions_addopen(&actions, r[i].fd, r[i].path, r[i].flags, 0644);
+
+    // exec the hashed path directly; if it vanished, forget it and search again
+    int cached, err = ENOENT;
+    char *path = resolve(argv[0], &cached);
+    if (path != NULL)
+        err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+    if (err == ENOENT && cached)
+    {
+        hashforget(argv[0]);
+        path = resolve(argv[0], &cached);
+        if (path != NULL)
+            err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0)
+    {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+/* moves everything from in to out inside the kernel: splice when either
+ * side is a pipe, sendfile from a file, read/write only as a last resort.
+ * returns 0 (also when the reader of out went away), or -1 on an error */
+int copyfd(int in, int out)
+{
+    struct stat sin, sout;
+    fstat(in, &sin);
+    fstat(out, &sout);
+    ssize_t n;
+
+    if (S_ISFIFO(sin.st_mode) || S_ISFIFO(sout.st_mode))
+    {
+        while (!interrupted && (n = splice(in, NULL, out, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
+            ;
+        if (interrupted || n == 0 || errno == EPIPE)
+            return 0;
+        if (errno != EINVAL)
+            return -1;
+    }
+    else if (S_ISREG(sin.st_mode))
+    {
+        while (!interrupted && (n = sendfile(out, in, NULL, 1 << 24)) > 0)
+            ;
+        if (interrupted || n == 0 || errno == EPIPE)
+            return 0;
+        if (errno != EINVAL)
+            return -1;
+    }
+
+    // e.g. terminal to terminal
+    char buf[BUFSIZ];
+    while (!interrupted && (n = read(in, buf, sizeof(buf))) > 0)
+    {
+        if (write(out, buf, n) != n)
+            return errno == EPIPE ? 0 : -1;
+    }
+    return n == 0 ? 0 : -1;
+}
+
+/* whether the shell can run argv itself: cat [file...] and tee [-a] [file],
+ * where a file of cat may be "-". Any other option or a second tee file
+ * goes to the real command */
+int fastform(char *argv[])
+{
+    int i = 1;
+    if (strcmp(argv[0], "cat") == 0)
+    {
+        for (; argv[i] != NULL; i++)
+        {
+            if (argv[i][0] == '-' && argv[i][1] != '\0')
+                return 0;
+        }
+        return 1;
+    }
+    if (strcmp(argv[0], "tee") != 0)
+        return 0;
+    if (argv[i] != NULL && strcmp(argv[i], "-a") == 0)
+        i++;
+    if (argv[i] != NULL && (argv[i][0] == '-' || argv[i + 1] != NULL))
+        return 0;
+    return 1;
+}
+
+/* whether the stage argv run in the shell would read the terminal: a cat
+ * without files or with "-", or a tee, left on the shell's own input */
+int readsterm(char *argv[], struct redirect *r, int n)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (r[i].fd == 0)
+            return 0;
+    }
+    if (!isatty(0))
+        return 0;
+    if (strcmp(argv[0], "tee") == 0 || argv[1] == NULL)
+        return 1;
+    for (int i = 1; argv[i] != NULL; i++)
+    {
+        if (strcmp(argv[i], "-") == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* builtin cat [file...]: files (or in) are copied to out without passing
+ * through user space. Returns the exit status, 1 if any file failed */
+int fastcat(char *argv[], int in, int out)
+{
+    int status = 0;
+    if (argv[1] == NULL && copyfd(in, out) == -1)
+    {
+        perror("cat");
+        status = 1;
+    }
+    for (int i = 1; argv[i] != NULL; i++)
+    {
+        int fd = strcmp(argv[i], "-") == 0 ? dup(in) : open(argv[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1 || copyfd(fd, out) == -1)
+        {
+            perror(argv[i]);
+            status = 1;
+        }
+        if (fd != -1)
+            close(fd);
+    }
+    return status;
+}
+
+/* builtin tee [-a] file: in is copied to out and to file. Between two pipes,
+ * tee(2) duplicates the data and splice moves it into the file, so nothing is
+ * copied through user space; otherwise it falls back to read/write.
+ * Returns the exit status */
+int fasttee(char *argv[], int in, int out)
+{
+    int append = argv[1] != NULL && strcmp(argv[1], "-a") == 0;
+    char *path = argv[1 + append];
+    int file = -1, status = 0;
+    if (path != NULL)
+    {
+        file = open(path, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+        if (file == -1)
+        {
+            perror(path);
+            status = 1;
+        }
+    }
 
-            if (strcmp(args[0], "cd") == 0)
+    struct stat sin, sout;
+    fstat(in, &sin);
+    fstat(out, &sout);
+    ssize_t n;
+    if (S_ISFIFO(sin.st_mode) && S_ISFIFO(sout.st_mode))
+    {
+        while (!interrupted && (n = tee(in, out, 1 << 20, 0)) > 0)
+        {
+            // consume what was duplicated: into the file, or drop it
+            int sink = file != -1 ? file : open("/dev/null", O_WRONLY | O_CLOEXEC);
+            while (n > 0)
             {
-                chdir(args[1]);
-                continue;
+                ssize_t moved = splice(in, NULL, sink, NULL, n, SPLICE_F_MOVE);
+                if (moved <= 0)
+                {
+                    // e.g. an O_APPEND file refuses splice: copy this part instead,
+                    // or the data stays in the pipe and is duplicated again
+                    char buf[BUFSIZ];
+                    moved = read(in, buf, n < (ssize_t)sizeof(buf) ? n : (ssize_t)sizeof(buf));
+                    if (moved <= 0 || write(sink, buf, moved) != moved)
+                        break;
+                }
+                n -= moved;
             }
-            if (strcmp(args[0], "jobs") == 0)
+            if (sink != file)
+                close(sink);
+        }
+    }
+    else
+    {
+        char buf[BUFSIZ];
+        while (!interrupted && (n = read(in, buf, sizeof(buf))) > 0)
+        {
+            if (write(out, buf, n) != n || (file != -1 && write(file, buf, n) != n))
             {
-                printf("background processes:\n");
-                for (int i = 0; jobs[i] != 0; i++)
-                    printf("[%d]%d\n", i + 1, jobs[i]);
-                continue;
+                // the reader going away ends the copy, it is not an error
+                if (errno != EPIPE)
+                {
+                    perror("tee");
+                    status = 1;
+                }
+                break;
             }
+        }
+    }
+    if (file != -1)
+        close(file);
+    return status;
+}
 
-            if (op == NULL)
+/* runs cmd1 | cmd2 | ... | cmdN, each with its own redirections: every stage
+ * is started before any is waited for, and the shell closes each pipe end once
+ * it is handed over. In a foreground pipeline, the first cat or tee stage in a
+ * form the shell implements (see fastform) runs in the shell itself with
+ * splice/sendfile, after the other stages started; its failure fails the
+ * pipeline.
+ * the spawned stages form one job: the shell waits for it unless bg is set */
+void pipeline(char *args[], int cnt, int bg, char *cmd)
+{
+    // split args in place: each "|" becomes the NULL ending a stage
+    char **stages[MAXSTAGES];
+    int nstages = 1;
+    stages[0] = args;
+    laststatus = 0;
+    for (int i = 0; i < cnt; i++)
+    {
+        if (args[i] == OP_PIPE)
+        {
+            if (nstages == MAXSTAGES)
             {
-                execvp(args[0], args);
-                continue;
+                printf("more than %d commands in a pipeline\n", MAXSTAGES);
+                laststatus = 2;
+                return;
             }
-            else if (strcmp(op, ">") == 0) // output redirection
+            args[i] = NULL;
+            stages[nstages++] = &args[i + 1];
+        }
+    }
+
+    struct redirect redirs[MAXSTAGES][4];
+    int nredirs[MAXSTAGES];
+    int fast = -1; // stage run in the shell
+    for (int k = 0; k < nstages; k++)
+    {
+        nredirs[k] = redirections(stages[k], redirs[k]);
+        if (stages[k][0] == NULL && nredirs[k] != -1)
+            printf("missing command around |\n");
+        if (nredirs[k] == -1 || stages[k][0] == NULL)
+        {
+            laststatus = 2;
+            return;
+        }
+        // interactively, the terminal belongs to the spawned stages while the
+        // shell copies: a lone cat or tee, or one reading the terminal, is spawned
+        // so that Ctrl+C, Ctrl+Z and job control reach whoever reads it
+        if (fast == -1 && bg == 0 && fastform(stages[k]) &&
+            !(interactive && (nstages == 1 || (k == 0 && readsterm(stages[k], redirs[k], nredirs[k])))))
+            fast = k;
+    }
+
+    // children are not reaped until the job is recorded, so the group
+    // leader cannot vanish before the later stages join its group
+    sigset_t old;
+    blockchld(&old);
+    fflush(stdout);
+    // free the slots of jobs that already finished; this runs before any stage
+    // starts, so no event of this pipeline is consumed before its job exists
+    drainevents();
+    interrupted = 0; // set by a Ctrl+C that reaches the shell, ends its copy
+
+    pid_t pids[MAXSTAGES];
+    int started = 0;
+    int in = -1;                    // reading end of the previous pipe
+    int fastin = -1, fastout = -1;  // pipe ends kept for the stage run in the shell
+    for (int k = 0; k < nstages; k++)
+    {
+        int fd[2] = {-1, -1};
+        if (k < nstages - 1)
+        {
+            if (pipe2(fd, O_CLOEXEC) == -1)
             {
-                printf("cmd1: %s\n", cmd1[0]);
-                printf("cmd2: %s\n", args[i + 1]);
+                perror("pipe");
+                break;
+            }
+            if (pipesize > 0 && fcntl(fd[1], F_SETPIPE_SZ, pipesize) == -1)
+                perror("F_SETPIPE_SZ");
+        }
 
-                dup2(fd[1], 1);
-                close(fd[1]);
-                close(fd[0]);
-                open(args[i + 1], O_CREAT, 0644);
-                execvp(cmd1[0], cmd1);
-                close(fd[0]);
+        pid_t pid = 0;
+        if (k == fast)
+        {
+            fastin = in;
+            fastout = fd[1];
+        }
+        else
+        {
+            pid = launch(stages[k], in, fd[1], redirs[k], nredirs[k], started > 0 ? pids[0] : 0);
+
+            // the child has its copies now
+            if (in != -1)
+                close(in);
+            if (fd[1] != -1)
                 close(fd[1]);
+        }
+        in = fd[0];
+
+        if (pid == -1)
+        {
+            laststatus = 127;
+            break;
+        }
+        if (pid > 0)
+            pids[started++] = pid;
+        // the terminal is the job's from its first process on: a stage
+        // that reads it must not be stopped while later ones start
+        if (pid > 0 && started == 1 && interactive && bg == 0)
+            tcsetpgrp(0, pid);
+    }
+    if (in != -1)
+        close(in);
+
+    struct job *j = NULL;
+    for (int i = 0; started > 0 && i < MAXJOBS; i++)
+    {
+        if (jobs[i].id == 0)
+        {
+            j = &jobs[i];
+            j->id = nextjobid++;
+            j->pgid = pids[0];
+            memcpy(j->pids, pids, sizeof(pid_t) * started);
+            j->npids = j->alive = started;
+            snprintf(j->cmd, sizeof(j->cmd), "%s", cmd);
+            j->start = now();
+            j->timed = timecmd || timeall;
+            break;
+        }
+    }
+    if (started > 0 && j == NULL)
+    {
+        printf("too many jobs, killing %s\n", cmd);
+        kill(-pids[0], SIGKILL);
+        if (interactive && bg == 0)
+            tcsetpgrp(0, shellpgid);
+    }
+    // Ctrl+C reaches the spawned stages while the shell copies, and a stage
+    // that reads the terminal (less) already owns it
+    if (j != NULL && fast != -1)
+        fgpgid = j->pgid;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    int faststatus = 0;
+    if (fast != -1)
+    {
+        // every other stage is running: move the data, then let the readers see EOF
+        int fdin = fastin != -1 ? fastin : 0;
+        int fdout = fastout != -1 ? fastout : 1;
+        int fderr = -1;
+        int opened[4], nopened = 0;
+        for (int i = 0; i < nredirs[fast]; i++)
+        {
+            struct redirect *r = &redirs[fast][i];
+            int fd = open(r->path, r->flags | O_CLOEXEC, 0644);
+            if (fd == -1)
+            {
+                perror(r->path);
+                faststatus = 1;
+                continue;
+            }
+            opened[nopened++] = fd;
+            if (r->fd == 0)
+                fdin = fd;
+            else if (r->fd == 1)
+                fdout = fd;
+            else
+                fderr = fd;
+        }
+
+        fflush(stdout);
+        // the stage reports its errors (perror) into its own 2>
+        int savederr = -1;
+        if (fderr != -1)
+        {
+            savederr = fcntl(2, F_DUPFD_CLOEXEC, 3);
+            dup2(fderr, 2);
+        }
+        // a failed redirection keeps the stage from running
+        if (faststatus == 0 && strcmp(stages[fast][0], "cat") == 0)
+            faststatus = fastcat(stages[fast], fdin, fdout);
+        else if (faststatus == 0)
+            faststatus = fasttee(stages[fast], fdin, fdout);
+        if (interrupted && faststatus == 0)
+            faststatus = 128 + SIGINT;
+        if (savederr != -1)
+        {
+            dup2(savederr, 2);
+            close(savederr);
+        }
+
+        for (int i = 0; i < nopened; i++)
+            close(opened[i]);
+        if (fastin != -1)
+            close(fastin);
+        if (fastout != -1)
+            close(fastout);
+    }
+
+    if (j != NULL && bg == 0) // no &: wait for the whole pipeline
+        waitjob(j);
+    else if (j != NULL) // &
+        printf("[%d] %d\n", j->id, j->pgid);
+    if (faststatus != 0 && laststatus == 0)
+        laststatus = faststatus;
+}
+
+/* returns word with every {} replaced by item, NULL if it has none */
+char *substitute(const char *word, const char *item)
+{
+    const char *p = strstr(word, "{}");
+    if (p == NULL)
+        return NULL;
+
+    size_t n = 0;
+    for (const char *q = p; q != NULL; q = strstr(q + 2, "{}"))
+        n++;
+    char *out = (char *)malloc(strlen(word) + n * strlen(item) + 1);
+    char *o = out;
+    for (; p != NULL; p = strstr(word, "{}"))
+    {
+        memcpy(o, word, p - word);
+        o += p - word;
+        strcpy(o, item);
+        o += strlen(item);
+        word = p + 2;
+    }
+    strcpy(o, word);
+    return out;
+}
+
+/* starts item number i of a parallel run in its own process group: as the
+ * last argument of command (or in place of its {}), or as a whole command
+ * line run by a child shell when there is no command */
+pid_t runitem(char *command[], char *item)
+{
+    if (command[0] == NULL)
+    {
+        char *argv[] = {"/proc/self/exe", "-c", item, NULL};
+        return launch(argv, -1, -1, NULL, 0, 0);
+    }
+
+    int n = 0, replaced = 0;
+    while (command[n] != NULL)
+        n++;
+    char **argv = (char **)malloc(sizeof(char *) * (n + 2));
+    for (int i = 0; i < n; i++)
+    {
+        argv[i] = substitute(command[i], item);
+        if (argv[i] != NULL)
+            replaced = 1;
+        else
+            argv[i] = command[i];
+    }
+    argv[n] = replaced ? NULL : item;
+    argv[n + 1] = NULL;
+
+    // posix_spawn returns after the exec, the child no longer needs argv
+    pid_t pid = launch(argv, -1, -1, NULL, 0, 0);
+    for (int i = 0; i < n; i++)
+    {
+        if (argv[i] != command[i])
+            free(argv[i]);
+    }
+    free(argv);
+    return pid;
+}
+
+/* parallel [-j N] [command...] ::: item...
+ * parallel [-j N] [command...] -a file
+ * runs command once per item (or per line of file), at most N at a time
+ * (default: one per CPU). A finished child is replaced by the next item right
+ * away. Without a command each item is a command line. laststatus is the
+ * number of failed items, at most 101 */
+void parallel(char *args[])
+{
+    int nslots = sysconf(_SC_NPROCESSORS_ONLN);
+    char **command = &args[1];
+    char **items = NULL;
+    char *file = NULL;
+    int nitems = 0;
 
+    if (args[1] != NULL && strcmp(args[1], "-j") == 0 && args[2] != NULL)
+    {
+        nslots = atoi(args[2]);
+        command = &args[3];
+    }
+    if (nslots < 1)
+        nslots = 1;
+    if (nslots > MAXSLOTS)
+        nslots = MAXSLOTS;
+
+    // the command ends at ::: or -a
+    int n = 0;
+    while (command[n] != NULL && strcmp(command[n], ":::") != 0 && strcmp(command[n], "-a") != 0)
+        n++;
+    if (command[n] != NULL && strcmp(command[n], ":::") == 0)
+    {
+        items = &command[n + 1];
+        while (items[nitems] != NULL)
+            nitems++;
+    }
+    else if (command[n] != NULL && command[n + 1] != NULL)
+    {
+        int fd = open(command[n + 1], O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1)
+        {
+            perror(command[n + 1]);
+            laststatus = 1;
+            return;
+        }
+        file = (char *)malloc(st.st_size + 1);
+        ssize_t got = 0, r;
+        while (got < st.st_size && (r = read(fd, file + got, st.st_size - got)) > 0)
+            got += r;
+        file[got] = '\0';
+        close(fd);
+
+        // one item per non-empty line, split in place
+        items = (char **)malloc(sizeof(char *) * (got + 1));
+        for (char *line = strtok(file, "\n"); line != NULL; line = strtok(NULL, "\n"))
+            items[nitems++] = line;
+    }
+    else
+    {
+        printf("usage: parallel [-j N] [command...] ::: item... | -a file\n");
+        laststatus = 2;
+        return;
+    }
+    command[n] = NULL;
+
+    int *status = (int *)calloc(nitems, sizeof(int));
+    int next = 0, running = 0;
+    sigset_t old;
+    blockchld(&old);
+    fflush(stdout);
+    interrupted = 0;
+    while (1)
+    {
+        // keep every slot busy; the slot table is only changed with SIGCHLD blocked
+        for (int s = 0; s < nslots && next < nitems && !interrupted; s++)
+        {
+            if (slots[s].pid != 0)
                 continue;
+            pid_t pid = runitem(command, items[next]);
+            if (pid == -1)
+                status[next] = 127 << 8;
+            else
+                slots[s] = (struct slot){pid, &status[next]};
+            next++;
+        }
+
+        running = 0;
+        for (int s = 0; s < nslots; s++)
+        {
+            if (slots[s].pid != 0)
+                running++;
+        }
+        if (running == 0)
+            break;
+
+        sigsuspend(&old);
+        if (interrupted)
+        {
+            // Ctrl+C: start nothing new, pass it on to what still runs
+            for (int s = 0; s < nslots; s++)
+            {
+                if (slots[s].pid != 0)
+                    kill(-slots[s].pid, SIGINT);
             }
-            else if (strcmp(op, "|") == 0) // piping
+        }
+        drainevents();
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    int failed = 0;
+    for (int i = 0; i < nitems; i++)
+    {
+        int code = i >= next ? -1 : exitcode(status[i]);
+        if (code == 0)
+            continue;
+        failed++;
+        if (code == -1)
+            printf("parallel: %s: not started\n", items[i]);
+        else
+            printf("parallel: %s: exit status %d\n", items[i], code);
+    }
+    laststatus = failed < 101 ? failed : 101;
+
+    free(status);
+    if (file != NULL)
+    {
+        free(items);
+        free(file);
+    }
+}
+
+/* input of the shell: stdin, a script file or the -c string. Files are read in
+ * INPUTSIZE chunks and lines are handed out in place, without copying */
+struct input
+{
+    int fd;      // -1 once everything is in buf (EOF, or a -c string)
+    char *buf;
+    size_t size; // allocated, grows for lines longer than the buffer
+    size_t start, end;
+} input;
+
+/* returns the next line of the input, NUL terminated in place of its '\n',
+ * NULL at end of input */
+char *nextline(struct input *in)
+{
+    while (1)
+    {
+        char *nl = memchr(in->buf + in->start, '\n', in->end - in->start);
+        if (nl != NULL || (in->fd == -1 && in->start < in->end))
+        {
+            char *line = in->buf + in->start;
+            if (nl == NULL)
+                nl = in->buf + in->end; // last line without a '\n', buf has room for the NUL
+            *nl = '\0';
+            in->start = nl - in->buf + 1;
+            if (in->start > in->end)
+                in->start = in->end;
+            return line;
+        }
+        if (in->fd == -1)
+            return NULL;
+
+        // keep the partial line, and make room for at least one more chunk
+        memmove(in->buf, in->buf + in->start, in->end - in->start);
+        in->end -= in->start;
+        in->start = 0;
+        if (in->size - in->end < INPUTSIZE / 2)
+        {
+            in->size *= 2;
+            in->buf = (char *)realloc(in->buf, in->size);
+        }
+
+        ssize_t n = read(in->fd, in->buf + in->end, in->size - in->end - 1);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            in->fd = -1;
+        else
+            in->end += n;
+    }
+}
+
+/* tokens of one line: words are copied into text, and args points into it.
+ * both only grow, and are reused for every line */
+struct arena
+{
+    char *text;
+    size_t textsize;
+    char **args;
+    size_t argsize;
+} arena;
+
+int isdelimiter(char c)
+{
+    switch (c)
+    {
+    case '\0':
+    case ' ':
+    case '\t':
+    case '\r':
+    case ';':
+    case '&':
+    case '|':
+    case '<':
+    case '>':
+        return 1;
+    }
+    return 0;
+}
+
+/* splits line into arena.args in one pass: words with '', "" and \ quoting,
+ * and every operator (;, &, &&, ||, |, <, >, >>, 2>) as its OP_* marker.
+ * returns the number of tokens, -1 on an unterminated quote */
+int lex(char *line)
+{
+    // a token needs at least one char of the line and adds at most one NUL
+    size_t len = strlen(line);
+    if (arena.textsize < 2 * len + 2)
+    {
+        arena.textsize = 2 * len + 2;
+        arena.text = (char *)realloc(arena.text, arena.textsize);
+    }
+    if (arena.argsize < len + 2)
+    {
+        arena.argsize = len + 2;
+        arena.args = (char **)realloc(arena.args, sizeof(char *) * arena.argsize);
+    }
+
+    char *p = line, *out = arena.text;
+    char **args = arena.args;
+    int n = 0;
+    while (1)
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\r')
+            p++;
+        if (*p == '\0' || *p == '#')
+            break;
+
+        if (*p == ';')
+            args[n++] = OP_SEQ, p++;
+        else if (p[0] == '&' && p[1] == '&')
+            args[n++] = OP_AND, p += 2;
+        else if (*p == '&')
+            args[n++] = OP_BG, p++;
+        else if (p[0] == '|' && p[1] == '|')
+            args[n++] = OP_OR, p += 2;
+        else if (*p == '|')
+            args[n++] = OP_PIPE, p++;
+        else if (*p == '<')
+            args[n++] = OP_IN, p++;
+        else if (p[0] == '>' && p[1] == '>')
+            args[n++] = OP_APPEND, p += 2;
+        else if (*p == '>')
+            args[n++] = OP_OUT, p++;
+        else if (p[0] == '2' && p[1] == '>')
+            args[n++] = OP_ERR, p += 2;
+        else
+        {
+            args[n++] = out;
+            while (!isdelimiter(*p))
             {
-                int k = 0;
-                for (i = i + 1; i < cnt; i++)
+                if (*p == '\\' && p[1] != '\0')
                 {
-                    if (args[i] == NULL)
-                        break;
-                    else
-                    {
-                        cmd2[k] = args[i];
-                        k++;
-                    }
+                    *out++ = p[1];
+                    p += 2;
                 }
-                cmd2[k] = NULL;
-
-                int fd[2];
-                pipe(fd);
-                if (fork() == 0)
+                else if (*p == '\'' || *p == '"')
                 {
-                    // child - reading end
-                    close(fd[1]);
-                    close(0);
-                    dup(fd[0]);
-                    execvp(cmd2[0], cmd2);
-                    close(fd[0]);
-                    continue;
+                    char quote = *p++;
+                    while (*p != quote && *p != '\0')
+                    {
+                        if (quote == '"' && *p == '\\' && (p[1] == '"' || p[1] == '\\'))
+                            p++;
+                        *out++ = *p++;
+                    }
+                    if (*p == '\0')
+                    {
+                        printf("unterminated %c\n", quote);
+                        return -1;
+                    }
+                    p++;
                 }
                 else
-                {
-                    // parent - writing end
-                    close(fd[0]);
-                    close(1);
-                    dup(fd[1]);
-                    execvp(cmd1[0], cmd1);
-                    close(fd[1]);
-                    continue;
-                }
+                    *out++ = *p++;
             }
+            *out++ = '\0';
         }
+    }
+    args[n] = NULL;
+    return n;
+}
+
+int iscontrol(char *token)
+{
+    return token == OP_SEQ || token == OP_BG || token == OP_AND || token == OP_OR;
+}
+
+/* runs one pipeline: builtins in the shell, anything else through pipeline().
+ * with a time prefix, or with timing on, its resources are reported once it
+ * finished in the foreground (background jobs report when they are done) */
+void runcommand(char *args[], int cnt, int bg)
+{
+    timecmd = strcmp(args[0], "time") == 0 && cnt > 1;
+    if (timecmd)
+        args++, cnt--;
+
+    // keep the command line for jobs before pipeline() splits args
+    char cmd[80];
+    cmd[0] = '\0';
+    for (int i = 0; i < cnt; i++)
+    {
+        strncat(cmd, args[i], sizeof(cmd) - strlen(cmd) - 1);
+        strncat(cmd, i < cnt - 1 ? " " : (bg ? " &" : ""), sizeof(cmd) - strlen(cmd) - 1);
+    }
+
+    // the shell's own share: builtins, and cat/tee stages run in the shell
+    struct rusage before, after;
+    double start = now();
+    memset(&cmdusage, 0, sizeof(cmdusage));
+    getrusage(RUSAGE_SELF, &before);
+
+    // builtins run in the shell: no fork, and cd changes the shell's directory
+    if (!builtin(args))
+        pipeline(args, cnt, bg, cmd);
+    if (bg)
+        return;
+
+    getrusage(RUSAGE_SELF, &after);
+    timersub(&after.ru_utime, &before.ru_utime, &after.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &after.ru_stime);
+    after.ru_maxrss = 0;
+    after.ru_minflt -= before.ru_minflt;
+    after.ru_majflt -= before.ru_majflt;
+    after.ru_nvcsw -= before.ru_nvcsw;
+    after.ru_nivcsw -= before.ru_nivcsw;
+    addusage(&cmdusage, &after);
+    report(cmd, start, &cmdusage, laststatus, timecmd || timeall);
+}
+
+/* runs the n tokens of a line: pipelines separated by ;, & (in the background),
+ * && (if the previous one succeeded) and || (if it failed) */
+void runline(char *args[], int n)
+{
+    // only ; may follow nothing, and && / || need a pipeline on each side
+    for (int i = 0; i < n; i++)
+    {
+        int empty = i == 0 || iscontrol(args[i - 1]);
+        if ((iscontrol(args[i]) && args[i] != OP_SEQ && empty) ||
+            ((args[i] == OP_AND || args[i] == OP_OR) && i == n - 1))
+        {
+            printf("syntax error near %s\n", args[i]);
+            return;
+        }
+    }
+
+    int start = 0, skip = 0;
+    for (int i = 0; i <= n; i++)
+    {
+        char *op = args[i]; // NULL at the end of the line
+        if (i < n && !iscontrol(op))
+            continue;
+
+        args[i] = NULL;
+        if (i > start && !skip)
+            runcommand(&args[start], i - start, op == OP_BG);
+
+        // a skipped pipeline leaves laststatus as it was
+        if (op == OP_AND)
+            skip = laststatus != 0;
+        else if (op == OP_OR)
+            skip = laststatus == 0;
         else
+            skip = 0;
+        start = i + 1;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    // sh -c "commands", sh script, or commands from stdin
+    input.fd = 0;
+    if (argc > 2 && strcmp(argv[1], "-c") == 0)
+    {
+        input.fd = -1;
+        input.buf = strdup(argv[2]);
+        input.size = input.end = strlen(argv[2]) + 1;
+        input.end--;
+    }
+    else if (argc > 1 && (input.fd = open(argv[1], O_RDONLY | O_CLOEXEC)) == -1)
+    {
+        perror(argv[1]);
+        return 127;
+    }
+    if (input.fd != -1)
+    {
+        input.size = INPUTSIZE;
+        input.buf = (char *)malloc(input.size);
+    }
+
+    // a job control shell: own process group, and the terminal when interactive
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_RESTART;
+    sa.sa_handler = handle_sigchld;
+    sigaction(SIGCHLD, &sa, NULL);
+    sa.sa_handler = handle_sigint;
+    sigaction(SIGINT, &sa, NULL); // Ctrl+C
+    sa.sa_handler = handle_sigstp;
+    sigaction(SIGTSTP, &sa, NULL); // Ctrl+Z
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN); // a cat/tee stage run in the shell sees EPIPE instead
+
+    shellpgid = getpid();
+    // take the terminal only if started in the foreground: a shell run by
+    // parallel must not steal it
+    interactive = isatty(0) && tcgetpgrp(0) == getpgrp();
+    setpgid(0, shellpgid);
+    if (interactive)
+        tcsetpgrp(0, shellpgid);
+    int prompt = interactive && input.fd == 0; // no prompt in batch mode
+
+    while (1)
+    {
+        // report background jobs that finished while the shell was waiting for input
+        sigset_t old;
+        blockchld(&old);
+        drainevents();
+        sigprocmask(SIG_SETMASK, &old, NULL);
+
+        if (prompt)
         {
-            // parent
-            // if (strcmp(args[0], "fg") == 0)
-            // {
-            //     if (args[1] == NULL)
-            //     {
-            //         args[1] = "0";
-            //         args[2] = NULL;
-            //     }
-
-            //     int i = atoi(args[1]);
-            //     printf("foreground process [%d]:\n", i);
-            //     if (jobs[1] == 0)
-            //     {
-            //         printf("wrong index\n");
-            //         continue;
-            //     }
-
-            //     pid_t wid = jobs[i];
-            //     waitpid(wid, NULL, 0);
-
-            //     // shift left
-            //     while (jobs[i] != 0)
-            //     {
-            //         jobs[i] = jobs[i + 1];
-            //     }
-            //     continue;
-            // }
-
-            if (bg == 0) // no &
-            {
-                waitpid(pid, NULL, 0);
-                continue;
-            }
-            else // &
-            {
-                int i = 0;
-                while (jobs[i] != 0)
-                    i++;
-                jobs[i] = pid;
-                continue;
-            }
+            printf("\n>> ");
+            fflush(stdout);
         }
+        char *line = nextline(&input);
+        if (line == NULL)
+            exit(laststatus);
+
+        int n = lex(line);
+        if (n > 0)
+            runline(arena.args, n);
     }
-    free(jobs);
-}
\ No newline at end of file
+}
@@ -1,5 +1,7 @@
 #include "sut.h"
 #include "queue.h"
+#include "P3-file_system/sfs_api.h"
+#include <stdio.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <ucontext.h>
@@ -7,6 +9,7 @@
 #include <time.h>
 
 int num_cexecutor = 1; // set to 1 or 2
+#define NUMIEXEC 4       // I-EXEC threads, the blocking calls of up to 4 tasks overlap
 
 struct queue rq; // ready queue (for C-EXECs)
 struct queue wq; // wait queue (for I-EXEC)
@@ -20,9 +23,46 @@ char tstack[30][16 * 1024];
 int idx = 0;
 
 // contexts for sut functions
-ucontext_t sutyield, sutexit, sutopen, sutread, sutwrite, sutclose;
+ucontext_t sutyield, sutexit;
 
-pthread_mutex_t lck; // mutex lock
+pthread_mutex_t lck;                                  // mutex lock, held by a C-EXEC while a task runs
+pthread_mutex_t wqlck = PTHREAD_MUTEX_INITIALIZER;    // protects wq, shared by the tasks and the I-EXECs
+pthread_mutex_t fileslck = PTHREAD_MUTEX_INITIALIZER; // protects the used flags of files
+pthread_mutex_t sfslck = PTHREAD_MUTEX_INITIALIZER;   // SFS keeps global state: one sfs_* call at a time,
+                                                      // released by SFS while it waits for data blocks
+
+#define MAXFILES 64 // files open through sut_open / sut_sfs_open at once
+
+// open files of the tasks, the fd returned to a task is the index
+// (a FILE* does not fit in an int on 64-bit machines)
+// only the I-EXECs touch this table
+struct sutfile
+{
+    int used;
+    FILE *fp;  // host file, NULL for an SFS file
+    int sfsid; // SFS fileID
+    int pos;   // read/write position in the SFS file, each fd has its own
+} files[MAXFILES];
+
+// an I/O operation handed from a task to the I-EXEC through wq
+enum ioop
+{
+    IO_OPEN,
+    IO_SFSOPEN,
+    IO_READ,
+    IO_WRITE,
+    IO_CLOSE
+};
+struct iorequest
+{
+    enum ioop op;
+    char *name; // IO_OPEN, IO_SFSOPEN
+    int fd;     // IO_READ, IO_WRITE, IO_CLOSE
+    char *buf;
+    int size;
+    int result;
+    struct queue_entry *task; // rq entry of the task, put back once done
+};
 
 void *cexec1();
 void *cexec2();
@@ -42,13 +82,14 @@ void sut_init()
     CEXEC = (pthread_t *)malloc(sizeof(pthread_t));
     if (num_cexecutor == 2)
         CEXEC2 = (pthread_t *)malloc(sizeof(pthread_t));
-    IEXEC = (pthread_t *)malloc(sizeof(pthread_t));
+    IEXEC = (pthread_t *)malloc(sizeof(pthread_t) * NUMIEXEC);
 
     // create threads for the executors
     pthread_create(CEXEC, NULL, cexec1, NULL);
     if (num_cexecutor == 2)
         pthread_create(CEXEC2, NULL, cexec2, NULL);
-    pthread_create(IEXEC, NULL, iexec, NULL);
+    for (int i = 0; i < NUMIEXEC; i++)
+        pthread_create(&IEXEC[i], NULL, iexec, NULL);
 }
 
 void *cexec1()
@@ -81,16 +122,113 @@ void *cexec2()
     }
 }
 
+// runs an SFS request with sfslck held, returns -1 on error
+int sfsdo(struct iorequest *req, struct sutfile *f)
+{
+    int n = -1;
+
+    pthread_mutex_lock(&sfslck);
+    switch (req->op)
+    {
+    case IO_SFSOPEN:
+        f->sfsid = n = sfs_fopen(req->name);
+        f->pos = 0;
+        break;
+    case IO_READ:
+    case IO_WRITE:
+        // each fd has its own position; sfs_fseek accepts the end of the file
+        if (sfs_fseek(f->sfsid, f->pos) == -1)
+            break;
+        n = req->op == IO_READ ? sfs_fread(f->sfsid, req->buf, req->size) : sfs_fwrite(f->sfsid, req->buf, req->size);
+        if (n > 0)
+            f->pos += n;
+        break;
+    case IO_CLOSE:
+        n = sfs_fclose(f->sfsid);
+        break;
+    default:
+        break;
+    }
+    pthread_mutex_unlock(&sfslck);
+    return n;
+}
+
+// runs one I/O request on an I-EXEC, returns -1 on error
+int iodo(struct iorequest *req)
+{
+    struct sutfile *f = &files[req->fd];
+    int n;
+
+    if (req->op != IO_OPEN && req->op != IO_SFSOPEN && !f->used)
+        return -1;
+
+    switch (req->op)
+    {
+    case IO_OPEN:
+    case IO_SFSOPEN:
+        // claim a slot, then open outside the lock
+        pthread_mutex_lock(&fileslck);
+        for (n = 0; n < MAXFILES && files[n].used; n++)
+            ;
+        if (n < MAXFILES)
+            files[n].used = 1;
+        pthread_mutex_unlock(&fileslck);
+        if (n == MAXFILES)
+            return -1;
+        f = &files[n];
+        f->fp = NULL;
+        if (req->op == IO_OPEN)
+            f->fp = fopen(req->name, "ab+");
+        if ((req->op == IO_OPEN && f->fp == NULL) || (req->op == IO_SFSOPEN && sfsdo(req, f) < 0))
+        {
+            f->used = 0;
+            return -1;
+        }
+        return n;
+    case IO_READ:
+        if (f->fp != NULL)
+            return fread(req->buf, 1, req->size, f->fp);
+        return sfsdo(req, f);
+    case IO_WRITE:
+        if (f->fp != NULL)
+            return fwrite(req->buf, 1, req->size, f->fp);
+        return sfsdo(req, f);
+    case IO_CLOSE:
+        n = f->fp != NULL ? fclose(f->fp) : sfsdo(req, f);
+        f->used = 0;
+        return n;
+    }
+    return -1;
+}
+
+// the I-EXECs do the blocking work of the tasks waiting in wq: a task waiting
+// for the disk only holds an I-EXEC, the C-EXECs go on with the ready tasks.
+// Host file calls of different tasks overlap across the I-EXECs. SFS keeps
+// global state, so sfs_* calls run one at a time (sfslck), but SFS releases
+// sfslck while it reads or writes data blocks: the disk waits of different
+// tasks overlap, and the blocks of one call go to the disk in parallel
 void *iexec()
 {
     while (true)
     {
-        if (queue_peek_front(&wq) != NULL)
+        pthread_mutex_lock(&wqlck);
+        struct queue_entry *e = queue_pop_head(&wq);
+        pthread_mutex_unlock(&wqlck);
+        if (e == NULL)
         {
-            struct queue_entry *e = queue_peek_front(&wq);
-            swapcontext(&iexeccontext, (ucontext_t *)e->data);
+            usleep(100);
+            continue;
         }
-        usleep(100);
+
+        struct iorequest *req = (struct iorequest *)e->data;
+        free(e);
+        req->result = iodo(req);
+
+        // the task is runnable again; rq is changed under lck, so this waits
+        // until the C-EXEC that suspended the task switched away from it
+        pthread_mutex_lock(&lck);
+        queue_insert_tail(&rq, req->task);
+        pthread_mutex_unlock(&lck);
     }
 }
 
@@ -135,88 +273,66 @@ void sut_exit()
 
 }
 
-int sut_open(char *dest)
+// suspends the running task until the I-EXEC did req and returns its result
+int iosubmit(struct iorequest *req)
 {
-    // pop a TCB from rq and link back to sut_open
-    struct queue_entry *e = queue_pop_head(&rq);
-    ucontext_t *tc = (ucontext_t *)e->data;
-    (*tc).uc_link = &sutopen;
-
-    // swap to C-EXEC
-    swapcontext(&sutopen, &cexec1context);
-
-    // put sut_open in wq
-    struct queue_entry *e1 = queue_new_node(&sutopen);
-    queue_insert_tail(&wq, e1);
+    // the running task is the head of the ready queue: move it out of rq,
+    // its request goes to the I-EXEC
+    req->task = queue_pop_head(&rq);
+    ucontext_t *tc = (ucontext_t *)req->task->data;
+
+    pthread_mutex_lock(&wqlck);
+    queue_insert_tail(&wq, queue_new_node(req));
+    pthread_mutex_unlock(&wqlck);
+
+    // back to the C-EXEC, resumed here once the task is in rq again
+    swapcontext(tc, &cexec1context);
+    return req->result;
+}
 
-    // complete IO operation and return
-    // open the file
-    int fd = (intptr_t)fopen(dest, "ab+");
+// mounts the SFS disk (a fresh one if fresh is 1) for sut_sfs_open,
+// call it after sut_init and before creating tasks that use SFS files
+void sut_sfs_mount(int fresh)
+{
+    sfs_setlock(&sfslck);
+    mksfs(fresh);
+}
 
-    // put the task back to ready queue
-    struct queue_entry *e2 = queue_new_node(tc);
-    queue_insert_tail(&rq, e2);
+int sut_open(char *dest)
+{
+    struct iorequest req = {IO_OPEN, dest};
+    return iosubmit(&req);
+}
 
-    return fd;
+// opens a file of the SFS disk, the fd works with sut_read, sut_write and sut_close
+int sut_sfs_open(char *name)
+{
+    struct iorequest req = {IO_SFSOPEN, name};
+    return iosubmit(&req);
 }
 
 char *sut_read(int fd, char *buf, int size)
 {
-    struct queue_entry *e = queue_pop_head(&rq);
-    ucontext_t *tc = (ucontext_t *)e->data;
-    (*tc).uc_link = &sutread;
-
-    swapcontext(&sutread, &cexec1context);
-
-    struct queue_entry *e1 = queue_new_node(&sutread);
-    queue_insert_tail(&wq, e1);
-
-    // read from the file
-    fread(buf, size, size, (FILE *)(long)fd);
-
-    // put the task back to ready queue
-    struct queue_entry *e2 = queue_new_node(tc);
-    queue_insert_tail(&rq, e2);
-
-    return buf;
+    if (fd < 0 || fd >= MAXFILES)
+        return NULL;
+    struct iorequest req = {IO_READ, NULL, fd, buf, size};
+    return iosubmit(&req) < 0 ? NULL : buf;
 }
 
 void sut_write(int fd, char *buf, int size)
 {
-    struct queue_entry *e = queue_pop_head(&rq);
-    ucontext_t *tc = (ucontext_t *)e->data;
-    (*tc).uc_link = &sutwrite;
-
-    swapcontext(&sutwrite, &cexec1context);
-
-    struct queue_entry *e1 = queue_new_node(&sutwrite);
-    queue_insert_tail(&wq, e1);
-
-    // write to the file
-    fwrite(buf, size, size, (FILE *)(long)fd);
-
-    // put the task back to ready queue
-    struct queue_entry *e2 = queue_new_node(tc);
-    queue_insert_tail(&rq, e2);
+    if (fd < 0 || fd >= MAXFILES)
+        return;
+    struct iorequest req = {IO_WRITE, NULL, fd, buf, size};
+    iosubmit(&req);
 }
 
 void sut_close(int fd)
 {
-    struct queue_entry *e = queue_pop_head(&rq);
-    ucontext_t *tc = (ucontext_t *)e->data;
-    (*tc).uc_link = &sutclose;
-
-    swapcontext(&sutclose, &cexec1context);
-
-    struct queue_entry *e1 = queue_new_node(&sutclose);
-    queue_insert_tail(&wq, e1);
-
-    // close the file
-    fclose((FILE *)(long)fd);
-
-    // put the task back to ready queue
-    struct queue_entry *e2 = queue_new_node(tc);
-    queue_insert_tail(&rq, e2);
+    if (fd < 0 || fd >= MAXFILES)
+        return;
+    struct iorequest req = {IO_CLOSE, NULL, fd};
+    iosubmit(&req);
 }
 
 void sut_shutdown()
@@ -228,6 +344,7 @@ void sut_shutdown()
     // join the executors then terminate the program
     pthread_join(*CEXEC, NULL);
     pthread_join(*CEXEC2, NULL);
-    pthread_join(*IEXEC, NULL);
+    for (int i = 0; i < NUMIEXEC; i++)
+        pthread_join(IEXEC[i], NULL);
     pthread_exit(NULL); // main exits
 }
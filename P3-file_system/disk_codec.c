@@ -0,0 +1,274 @@
+#include <string.h>
+#include "disk_codec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_PATH
+#endif
+
+#define CRC32C_POLY 0x82F63B78 /*reflected Castagnoli polynomial*/
+#define MINMATCH 4             /*shortest match worth an offset*/
+#define HASHBITS 10            /*match finder: 1024 recent positions*/
+#define MAXOFFSET 65535        /*offsets are 2 bytes*/
+
+static uint32_t crc_table[256];
+static int crc_ready = 0; /*0: not probed, 1: table, 2: SSE4.2*/
+
+/*-----------------------------------------------------*/
+/*Builds the byte-at-a-time table and probes for SSE4.2 */
+/*-----------------------------------------------------*/
+static void crc_init()
+{
+    uint32_t c;
+    int i, k;
+
+    for (i = 0; i < 256; i++)
+    {
+        c = i;
+        for (k = 0; k < 8; k++)
+        {
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+    crc_ready = 1;
+#ifdef HAVE_SSE42_PATH
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crc_ready = 2;
+    }
+#endif
+}
+
+#ifdef HAVE_SSE42_PATH
+/*-------------------------------------------------------------*/
+/*crc32 instruction, 8 bytes at a time on 64-bit, then the tail */
+/*-------------------------------------------------------------*/
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+#ifdef __x86_64__
+    uint64_t c = crc, v;
+
+    for (; len >= 8; len -= 8, p += 8)
+    {
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (uint32_t)c;
+#endif
+    for (; len > 0; len--)
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+/*-------------------------------------------------------*/
+/*CRC32C of a buffer, continuing from a previous crc (0)  */
+/*-------------------------------------------------------*/
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+
+    if (!crc_ready)
+    {
+        crc_init();
+    }
+    crc = ~crc;
+#ifdef HAVE_SSE42_PATH
+    if (crc_ready == 2)
+    {
+        return ~crc32c_hw(crc, p, len);
+    }
+#endif
+    for (; len > 0; len--)
+    {
+        crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/*---------------------------------------------------------------*/
+/*Hashes the 4 bytes at p into the match finder table             */
+/*---------------------------------------------------------------*/
+static unsigned hash4(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - HASHBITS);
+}
+
+/*---------------------------------------------------------------*/
+/*Writes the bytes of a length past the 15 held in a token nibble */
+/*---------------------------------------------------------------*/
+static unsigned char *put_length(unsigned char *op, int len)
+{
+    for (len -= 15; len >= 255; len -= 255)
+    {
+        *op++ = 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/*------------------------------------------------------------------*/
+/*Emits one sequence: token, literals and, with an offset, the match.*/
+/*Returns the new output position, or NULL if it does not fit        */
+/*------------------------------------------------------------------*/
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend, const unsigned char *anchor, int lit,
+                                   int offset, int match)
+{
+    unsigned char *token = op++;
+    int ml = match - MINMATCH;
+
+    /*Worst case: token, literals, their length bytes, offset, match length bytes*/
+    if (oend - op < lit + lit / 255 + 1 + (offset ? 2 + ml / 255 + 1 : 0))
+    {
+        return NULL;
+    }
+    *token = (unsigned char)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15)
+    {
+        op = put_length(op, lit);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    if (offset)
+    {
+        *op++ = (unsigned char)(offset & 0xFF);
+        *op++ = (unsigned char)(offset >> 8);
+        *token |= ml >= 15 ? 15 : ml;
+        if (ml >= 15)
+        {
+            op = put_length(op, ml);
+        }
+    }
+    return op;
+}
+
+/*------------------------------------------------------------------*/
+/*Greedy LZ77 with a single-entry hash table of recent positions.    */
+/*Each sequence is a token (literal length in the high nibble, match */
+/*length - 4 in the low one, 15 meaning more length bytes follow),   */
+/*the literals and a 2-byte little-endian offset; the last sequence  */
+/*has literals only                                                  */
+/*------------------------------------------------------------------*/
+int lz_compress(const void *src, int n, void *dst, int max)
+{
+    const unsigned char *in = (const unsigned char *)src;
+    const unsigned char *ip = in, *anchor = in, *end = in + n, *ref;
+    unsigned char *op = (unsigned char *)dst, *oend = op + max;
+    unsigned short table[1 << HASHBITS];
+    unsigned h;
+    int len;
+
+    if (n > MAXOFFSET)
+    {
+        return 0;
+    }
+    memset(table, 0, sizeof(table));
+
+    while (ip + MINMATCH <= end)
+    {
+        h = hash4(ip);
+        ref = in + table[h];
+        table[h] = (unsigned short)(ip - in);
+        if (ref >= ip || memcmp(ref, ip, MINMATCH) != 0)
+        {
+            ip++;
+            continue;
+        }
+
+        /*Extends the match; it may overlap ip, which encodes runs*/
+        for (len = MINMATCH; ip + len < end && ref[len] == ip[len]; len++)
+            ;
+        op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, len);
+        if (op == NULL)
+        {
+            return 0;
+        }
+        ip += len;
+        anchor = ip;
+    }
+
+    op = put_sequence(op, oend, anchor, end - anchor, 0, MINMATCH);
+    return op == NULL ? 0 : op - (unsigned char *)dst;
+}
+
+/*------------------------------------------------------------------*/
+/*Reads the extra bytes of a length. Returns -1 past the input end   */
+/*------------------------------------------------------------------*/
+static int get_length(const unsigned char **ip, const unsigned char *iend, int len)
+{
+    unsigned char b;
+
+    do
+    {
+        if (*ip >= iend)
+        {
+            return -1;
+        }
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+/*------------------------------------------------------------------*/
+/*Decodes lz_compress output, checking every length and offset       */
+/*against both buffers so a corrupted block cannot overrun them      */
+/*------------------------------------------------------------------*/
+int lz_decompress(const void *src, int n, void *dst, int max)
+{
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + n, *ref;
+    unsigned char *out = (unsigned char *)dst, *op = out, *oend = out + max;
+    int token, lit, len, offset;
+
+    while (ip < iend)
+    {
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15 && (lit = get_length(&ip, iend, lit)) < 0)
+        {
+            return -1;
+        }
+        if (lit > iend - ip || lit > oend - op)
+        {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+
+        if (ip == iend)
+        {
+            break; /*last sequence: literals only*/
+        }
+        if (iend - ip < 2)
+        {
+            return -1;
+        }
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        len = token & 15;
+        if (len == 15 && (len = get_length(&ip, iend, len)) < 0)
+        {
+            return -1;
+        }
+        len += MINMATCH;
+        if (offset == 0 || offset > op - out || len > oend - op)
+        {
+            return -1;
+        }
+
+        /*Byte by byte: the match may overlap what it produces*/
+        for (ref = op - offset; len > 0; len--)
+        {
+            *op++ = *ref++;
+        }
+    }
+    return op - out;
+}
@@ -0,0 +1,19 @@
+#ifndef DISK_CODEC_H
+#define DISK_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* block codec used by disk_emu when a codec is selected (see disk_set_codec) */
+
+// CRC32C (Castagnoli), with the SSE4.2 crc32 instruction when the CPU has it;
+// pass 0 as crc for the first buffer and the previous result to continue
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+// LZ77 in the LZ4 block format. lz_compress returns the compressed size, or 0
+// if the result would not fit in max bytes (store the block raw instead).
+// lz_decompress returns the decompressed size, or -1 for a malformed input
+int lz_compress(const void *src, int n, void *dst, int max);
+int lz_decompress(const void *src, int n, void *dst, int max);
+
+#endif
@@ -1,14 +1,305 @@
+#define _GNU_SOURCE /*SEEK_DATA/SEEK_HOLE*/
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "disk_emu.h"
+#include "disk_codec.h"
+
+#define AIO_WINDOW 64 /*most requests the scheduler looks at at once*/
+#define FRAME_MAGIC 0xB100 /*high byte of the flags of every frame*/
+#define FRAME_LZ 0x01      /*payload is lz_compress output, else raw*/
+#define MAP_BYTES (MAX_BLOCK / 8 + 1)            /*size of the written map*/
+#define MAP_START ((off_t)MAX_BLOCK * SLOT_SIZE) /*written map of a codec image, after the last slot*/
 
 FILE *fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+int fd = -1; /*descriptor of fp, used with pread/pwrite*/
+unsigned char *written = NULL; /*bit per block: written since the format*/
+int BLOCK_SIZE, MAX_BLOCK;
+int SLOT_SIZE;                   /*bytes per block in the file: BLOCK_SIZE + frame header with a codec*/
+int codec = 0;                   /*DISK_CODEC_* flags of the open disk*/
+int next_codec = 0;              /*flags for the next init, see disk_set_codec*/
+unsigned short *extent = NULL;   /*frame length of every block, 0 if unknown (codec only)*/
+struct disk_stats stats;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER; /*device model and stats*/
+
+/*Device model, all 0's is a free in-memory disk (see disk_set_model)*/
+struct disk_model model;
+int head = 0;          /*block under the head after the last request*/
+double clock_us = 0;   /*modeled device time since start, in microseconds*/
+double sleep_debt = 0; /*modeled time not slept yet when model.sleep is set*/
+int direction = 1;     /*elevator sweep direction: 1 up, -1 down*/
+
+/*Asynchronous request queues, see disk_submit*/
+pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t aio_work = PTHREAD_COND_INITIALIZER; /*request pending or stopping*/
+pthread_cond_t aio_done = PTHREAD_COND_INITIALIZER; /*request completed*/
+struct disk_request *pending_head = NULL, *pending_tail = NULL;
+struct disk_request *completed_head = NULL, *completed_tail = NULL;
+int inflight = 0; /*submitted and not completed yet*/
+pthread_t *workers = NULL;
+int nworkers = 0;
+int aio_stop = 0;
+
+/*Built-in codecs for disk_set_codec*/
+struct codec_name
+{
+    const char *name;
+    int flags;
+} codecs[] = {
+    {"none", 0},
+    {"crc", DISK_CODEC_CRC},
+    {"lz", DISK_CODEC_LZ},
+    {"lz+crc", DISK_CODEC_LZ | DISK_CODEC_CRC},
+};
+
+/*Built-in device profiles for disk_set_profile*/
+struct profile
+{
+    const char *name;
+    struct disk_model model;
+} profiles[] = {
+    /*name  seek  /block  max    xfer  qd  scheduler            deadline fail retry sleep*/
+    {"none", {0, 0, 0, 0, 1, DISK_SCHED_FIFO, 0, 0, 0, 0}},
+    /*7200rpm: settle + half a rotation, 150MB/s media rate*/
+    {"hdd", {4000, 2, 12000, 6.5, 32, DISK_SCHED_ELEVATOR, 0, 0, 3, 0}},
+    /*SATA flash: flat access latency, 500MB/s, no reordering benefit*/
+    {"ssd", {80, 0, 0, 2, 32, DISK_SCHED_FIFO, 0, 0, 3, 0}},
+    /*hdd with a 50ms deadline so far-away requests are not starved*/
+    {"hdd-deadline", {4000, 2, 12000, 6.5, 32, DISK_SCHED_DEADLINE, 50000, 0, 3, 0}},
+};
+
+/*------------------------------------------------*/
+/*Copies the I/O counters into the caller's struct*/
+/*------------------------------------------------*/
+void disk_get_stats(struct disk_stats *out)
+{
+    pthread_mutex_lock(&lock);
+    *out = stats;
+    pthread_mutex_unlock(&lock);
+}
+
+/*----------------------------*/
+/*Resets the I/O counters to 0*/
+/*----------------------------*/
+void disk_reset_stats()
+{
+    pthread_mutex_lock(&lock);
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_unlock(&lock);
+}
+
+/*-------------------------------------------------------*/
+/*Sets the latency/bandwidth/failure model of the device */
+/*-------------------------------------------------------*/
+void disk_set_model(const struct disk_model *m)
+{
+    model = *m;
+    if (model.queue_depth < 1)
+    {
+        model.queue_depth = 1;
+    }
+}
+
+/*------------------------------------------------------------*/
+/*Selects a built-in model by name, returns -1 if there is none*/
+/*------------------------------------------------------------*/
+int disk_set_profile(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int)(sizeof(profiles) / sizeof(profiles[0])); i++)
+    {
+        if (strcmp(profiles[i].name, name) == 0)
+        {
+            disk_set_model(&profiles[i].model);
+            return 0;
+        }
+    }
+    printf("unknown disk profile %s\n", name);
+    return -1;
+}
+
+/*------------------------------------------------------------------*/
+/*Selects the block codec by name. Takes effect at the next          */
+/*init_disk/init_fresh_disk, and an image must be reopened with the  */
+/*codec it was written with. Returns -1 if there is none             */
+/*------------------------------------------------------------------*/
+int disk_set_codec(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int)(sizeof(codecs) / sizeof(codecs[0])); i++)
+    {
+        if (strcmp(codecs[i].name, name) == 0)
+        {
+            next_codec = codecs[i].flags;
+            return 0;
+        }
+    }
+    printf("unknown disk codec %s\n", name);
+    return -1;
+}
+
+/*----------------------------------------------------------*/
+/*Adds modeled time to the device clock, sleeping if asked  */
+/*----------------------------------------------------------*/
+static void charge(double us)
+{
+    clock_us += us;
+    stats.busy_us += us;
+
+    if (model.sleep)
+    {
+        /*usleep has microsecond granularity, carry the remainder over*/
+        sleep_debt += us;
+        if (sleep_debt >= 1)
+        {
+            usleep((useconds_t)sleep_debt);
+            sleep_debt -= (useconds_t)sleep_debt;
+        }
+    }
+}
+
+/*------------------------------------------------------------*/
+/*Moves the head to a block, charging the seek for the distance*/
+/*------------------------------------------------------------*/
+static void seek_to(int address)
+{
+    int distance = abs(address - head);
+    double us;
+
+    if (distance == 0)
+    {
+        return;
+    }
+    stats.seeks++;
+    us = model.seek_us + model.seek_us_per_block * distance;
+    if (model.max_seek_us > 0 && us > model.max_seek_us)
+    {
+        us = model.max_seek_us;
+    }
+    charge(us);
+    head = address;
+}
+
+/*-----------------------------------------------------------------*/
+/*Charges one block transfer of the given bytes, injecting failures */
+/*with probability fail_prob. Returns 0 on success, -1 once         */
+/*max_retry retries failed                                          */
+/*-----------------------------------------------------------------*/
+static int transfer_block(int bytes)
+{
+    int tries;
+
+    for (tries = 0; tries <= model.max_retry; tries++)
+    {
+        charge(model.transfer_us * bytes / BLOCK_SIZE);
+        if (model.fail_prob <= 0 || (double)rand() / RAND_MAX >= model.fail_prob)
+        {
+            head++;
+            return 0;
+        }
+        stats.failures++;
+    }
+    return -1;
+}
+
+/*------------------------------------------------------------------*/
+/*Picks the next request to serve from a queue according to the     */
+/*scheduler of the model. Returns its position in the queue         */
+/*------------------------------------------------------------------*/
+int disk_pick(struct disk_request **queue, int n)
+{
+    int i, best, pass;
+
+    if (model.scheduler == DISK_SCHED_FIFO || n == 1)
+    {
+        return 0;
+    }
+
+    /*Deadline: the oldest request goes first once it has waited too long*/
+    if (model.scheduler == DISK_SCHED_DEADLINE)
+    {
+        best = 0;
+        for (i = 1; i < n; i++)
+        {
+            if (queue[i]->submitted < queue[best]->submitted)
+            {
+                best = i;
+            }
+        }
+        if (clock_us - queue[best]->submitted > model.deadline_us)
+        {
+            return best;
+        }
+    }
+
+    /*Elevator: nearest request in the sweep direction, reverse at the end*/
+    for (pass = 0; pass < 2; pass++)
+    {
+        best = -1;
+        for (i = 0; i < n; i++)
+        {
+            int distance = (queue[i]->start_address - head) * direction;
+            if (distance >= 0 && (best == -1 || distance < (queue[best]->start_address - head) * direction))
+            {
+                best = i;
+            }
+        }
+        if (best != -1)
+        {
+            return best;
+        }
+        direction = -direction;
+    }
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Serves a batch of requests, keeping up to queue_depth of them in  */
+/*the scheduler queue. Returns the number of failed requests        */
+/*------------------------------------------------------------------*/
+int disk_io_batch(struct disk_request *reqs, int n)
+{
+    struct disk_request **queue;
+    int i, queued = 0, next = 0, errors = 0;
+    int depth = model.queue_depth > 0 ? model.queue_depth : 1;
+
+    queue = (struct disk_request **)malloc(sizeof(struct disk_request *) * depth);
+
+    while (next < n || queued > 0)
+    {
+        /*Admits requests until the queue is full*/
+        while (next < n && queued < depth)
+        {
+            reqs[next].submitted = clock_us;
+            queue[queued++] = &reqs[next++];
+        }
+
+        i = disk_pick(queue, queued);
+        if (queue[i]->write)
+        {
+            queue[i]->result = write_blocks(queue[i]->start_address, queue[i]->nblocks, queue[i]->buffer);
+        }
+        else
+        {
+            queue[i]->result = read_blocks(queue[i]->start_address, queue[i]->nblocks, queue[i]->buffer);
+        }
+        if (queue[i]->result < 0)
+        {
+            errors++;
+        }
+        queue[i] = queue[--queued];
+    }
+
+    free(queue);
+    return errors;
+}
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
@@ -18,23 +309,110 @@ int close_disk()
     if (NULL != fp)
     {
         fclose(fp);
+        fp = NULL;
+        fd = -1;
     }
+    free(written);
+    written = NULL;
+    free(extent);
+    extent = NULL;
     return 0;
 }
 
-/*---------------------------------------*/
-/*Initializes a disk file filled with 0's*/
-/*---------------------------------------*/
-int init_fresh_disk(char *filename, int block_size, int num_blocks)
+/*-------------------------------------------------------------*/
+/*Allocates the map of written blocks, all marked never-written,*/
+/*and with a codec the map of frame lengths, all unknown        */
+/*-------------------------------------------------------------*/
+static int init_written_map()
+{
+    free(written);
+    free(extent);
+    written = (unsigned char *)calloc(MAP_BYTES, 1);
+    extent = codec ? (unsigned short *)calloc(MAX_BLOCK, sizeof(unsigned short)) : NULL;
+    return written == NULL || (codec && extent == NULL) ? -1 : 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Marks the blocks of an existing disk file that hold data, using   */
+/*SEEK_DATA/SEEK_HOLE. Without hole support, every block is marked  */
+/*------------------------------------------------------------------*/
+static void mark_data_blocks()
+{
+    off_t end = (off_t)MAX_BLOCK * SLOT_SIZE;
+    off_t data = 0, hole;
+    int b;
+
+    while (data < end)
+    {
+        data = lseek(fd, data, SEEK_DATA);
+        if (data < 0)
+        {
+            if (errno == ENXIO)
+            {
+                return; /*no data past this point*/
+            }
+            data = 0; /*not supported: treat the whole disk as written*/
+            hole = end;
+        }
+        else
+        {
+            hole = lseek(fd, data, SEEK_HOLE);
+            if (hole < 0 || hole > end)
+            {
+                hole = end;
+            }
+        }
+        for (b = data / SLOT_SIZE; b < MAX_BLOCK && (off_t)b * SLOT_SIZE < hole; b++)
+        {
+            written[b / 8] |= 1 << (b % 8);
+        }
+        data = hole;
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*Loads the written map a codec image keeps after its last slot. An  */
+/*image without one gets it from its data extents, keeping the slots */
+/*that start with a frame header, and then stores it                 */
+/*------------------------------------------------------------------*/
+static int load_written_map()
 {
-    int i, j;
+    struct stat st;
+    unsigned char header[DISK_FRAME_HEADER], zeros[DISK_FRAME_HEADER] = {0};
+    int b;
 
+    if (fstat(fd, &st) == 0 && st.st_size >= MAP_START + MAP_BYTES)
+    {
+        return pread(fd, written, MAP_BYTES, MAP_START) == MAP_BYTES ? 0 : -1;
+    }
+    mark_data_blocks();
+    for (b = 0; b < MAX_BLOCK; b++)
+    {
+        if ((written[b / 8] & (1 << (b % 8))) &&
+            pread(fd, header, sizeof(header), (off_t)b * SLOT_SIZE) == sizeof(header) &&
+            memcmp(header, zeros, sizeof(header)) == 0)
+        {
+            written[b / 8] &= ~(1 << (b % 8));
+        }
+    }
+    return pwrite(fd, written, MAP_BYTES, MAP_START) == MAP_BYTES ? 0 : -1;
+}
+
+/*------------------------------------------------------------------*/
+/*Initializes a disk file filled with 0's. The file is sparse: it is */
+/*only sized, and blocks read before their first write are 0's       */
+/*------------------------------------------------------------------*/
+int init_fresh_disk(char *filename, int block_size, int num_blocks)
+{
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
+    codec = next_codec;
+    SLOT_SIZE = codec ? BLOCK_SIZE + DISK_FRAME_HEADER : BLOCK_SIZE;
 
     /*Initializes the random number generator*/
     srand((unsigned int)(time(0)));
     /*Creates a new file*/
+    close_disk();
     fp = fopen(filename, "w+b");
 
     if (fp == NULL)
@@ -42,14 +420,15 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
         printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
+    fd = fileno(fp);
 
-    /*Fills the file with 0's to its given size*/
-    for (i = 0; i < MAX_BLOCK; i++)
+    /*Sizes the file without writing it: the holes read as 0's. A codec*/
+    /*image also holds the written map, all never-written               */
+    if (ftruncate(fd, MAP_START + (codec ? MAP_BYTES : 0)) != 0 || init_written_map() != 0)
     {
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            fputc(0, fp);
-        }
+        printf("Could not size disk file %s\n\n", filename);
+        close_disk();
+        return -1;
     }
     return 0;
 }
@@ -60,8 +439,11 @@ int init_disk(char *filename, int block_size, int num_blocks)
 {
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
+    codec = next_codec;
+    SLOT_SIZE = codec ? BLOCK_SIZE + DISK_FRAME_HEADER : BLOCK_SIZE;
 
     /*Opens a file*/
+    close_disk();
     fp = fopen(filename, "r+b");
 
     if (fp == NULL)
@@ -69,40 +451,324 @@ int init_disk(char *filename, int block_size, int num_blocks)
         printf("Could not open %s\n\n", filename);
         return -1;
     }
+    fd = fileno(fp);
+
+    /*Marks the blocks holding data; holes stay implicitly 0. A codec*/
+    /*image keeps an exact map: a slot of 0's is only valid unwritten */
+    if (init_written_map() != 0 || (codec && load_written_map() != 0))
+    {
+        printf("Could not read the written map of %s\n\n", filename);
+        close_disk();
+        return -1;
+    }
+    if (!codec)
+    {
+        mark_data_blocks();
+    }
     return 0;
 }
 
-/*-------------------------------------------------------------------*/
-/*Reads a series of blocks from the disk into the buffer             */
-/*-------------------------------------------------------------------*/
-int read_blocks(int start_address, int nblocks, void *buffer)
+/*------------------------------------------------------------------*/
+/*Builds the frame of a block: header, then the compressed payload,  */
+/*or the raw block if it does not shrink. Returns the frame length   */
+/*------------------------------------------------------------------*/
+static int encode(const char *block, unsigned char *frame)
+{
+    uint32_t crc = 0;
+    uint16_t length = 0, flags = FRAME_MAGIC;
+
+    if (codec & DISK_CODEC_LZ)
+    {
+        length = (uint16_t)lz_compress(block, BLOCK_SIZE, frame + DISK_FRAME_HEADER, BLOCK_SIZE - 1);
+    }
+    if (length > 0)
+    {
+        flags |= FRAME_LZ;
+    }
+    else
+    {
+        length = (uint16_t)BLOCK_SIZE;
+        memcpy(frame + DISK_FRAME_HEADER, block, BLOCK_SIZE);
+    }
+    if (codec & DISK_CODEC_CRC)
+    {
+        crc = crc32c(0, block, BLOCK_SIZE);
+    }
+    memcpy(frame, &crc, 4);
+    memcpy(frame + 4, &length, 2);
+    memcpy(frame + 6, &flags, 2);
+    return DISK_FRAME_HEADER + length;
+}
+
+/*------------------------------------------------------------------*/
+/*Restores a block from its frame, checking the header, the payload  */
+/*and the CRC. Returns the frame length, or -1 if the frame is bad,  */
+/*such as a written slot of 0's                                      */
+/*------------------------------------------------------------------*/
+static int decode(const unsigned char *frame, char *block)
+{
+    uint32_t crc;
+    uint16_t length, flags;
+
+    memcpy(&crc, frame, 4);
+    memcpy(&length, frame + 4, 2);
+    memcpy(&flags, frame + 6, 2);
+    if ((flags & ~FRAME_LZ) != FRAME_MAGIC || length > BLOCK_SIZE)
+    {
+        return -1;
+    }
+    if (flags & FRAME_LZ)
+    {
+        if (lz_decompress(frame + DISK_FRAME_HEADER, length, block, BLOCK_SIZE) != BLOCK_SIZE)
+        {
+            return -1;
+        }
+    }
+    else if (length == BLOCK_SIZE)
+    {
+        memcpy(block, frame + DISK_FRAME_HEADER, BLOCK_SIZE);
+    }
+    else
+    {
+        return -1;
+    }
+    if ((codec & DISK_CODEC_CRC) && crc32c(0, block, BLOCK_SIZE) != crc)
+    {
+        return -1;
+    }
+    return DISK_FRAME_HEADER + length;
+}
+
+/*------------------------------------------------------------------*/
+/*transfer() with a codec: every block is a frame at the start of    */
+/*its slot, and the model is charged for the frame bytes only. Reads */
+/*use the frame lengths learnt from earlier writes and reads         */
+/*------------------------------------------------------------------*/
+static int transfer_frames(int write, int start_address, int nblocks, char *buffer)
 {
-    int i, s;
-    s = 0;
+    unsigned char *slots;
+    int *length;
+    int i, b, bytes, bad = -1, first_new = -1, last_new = -1;
+    ssize_t n = 0;
+
+    slots = (unsigned char *)malloc((size_t)nblocks * SLOT_SIZE);
+    length = (int *)malloc(sizeof(int) * nblocks);
+    if (slots == NULL || length == NULL)
+    {
+        free(slots);
+        free(length);
+        return -1;
+    }
+
+    /*Compresses and checksums before taking the device*/
+    for (i = 0; write && i < nblocks; i++)
+    {
+        length[i] = encode(buffer + (size_t)i * BLOCK_SIZE, slots + (size_t)i * SLOT_SIZE);
+    }
+
+    pthread_mutex_lock(&lock);
+    if (write)
+    {
+        stats.write_calls++;
+        stats.blocks_written += nblocks;
+    }
+    else
+    {
+        stats.read_calls++;
+        stats.blocks_read += nblocks;
+    }
+    seek_to(start_address);
+
+    for (i = 0; i < nblocks; ++i)
+    {
+        b = start_address + i;
+        if (!write)
+        {
+            /*Never-written blocks are 0's without a frame; unknown lengths cost a full slot*/
+            length[i] = written[b / 8] & (1 << (b % 8)) ? (extent[b] ? extent[b] : SLOT_SIZE) : 0;
+        }
+        bytes = length[i] > 0 ? length[i] : BLOCK_SIZE;
+        if (transfer_block(bytes) < 0)
+        {
+            break;
+        }
+        if (write)
+        {
+            if (!(written[b / 8] & (1 << (b % 8))))
+            {
+                first_new = first_new < 0 ? b : first_new;
+                last_new = b;
+            }
+            written[b / 8] |= 1 << (b % 8);
+            extent[b] = (unsigned short)length[i];
+            stats.bytes_written += bytes;
+        }
+        else
+        {
+            stats.bytes_read += length[i];
+        }
+    }
+    /*Stores the map bytes of first writes before the frames, so that a*/
+    /*written slot still holding 0's is a bad block. Under the lock,   */
+    /*concurrent writers of one map byte cannot store an older copy    */
+    if (first_new >= 0)
+    {
+        n = pwrite(fd, written + first_new / 8, last_new / 8 - first_new / 8 + 1, MAP_START + first_new / 8);
+    }
+    pthread_mutex_unlock(&lock);
+
+    /*Moves the frames transferred before any failure*/
+    for (b = 0; write && b < i && n >= 0; b++)
+    {
+        n = pwrite(fd, slots + (size_t)b * SLOT_SIZE, length[b], (off_t)(start_address + b) * SLOT_SIZE);
+    }
+    if (!write && i > 0)
+    {
+        n = pread(fd, slots, (size_t)i * SLOT_SIZE, (off_t)start_address * SLOT_SIZE);
+        for (b = 0; b < i && n >= 0; b++)
+        {
+            if (length[b] == 0)
+            {
+                memset(buffer + (size_t)b * BLOCK_SIZE, 0, BLOCK_SIZE);
+            }
+            else if ((length[b] = decode(slots + (size_t)b * SLOT_SIZE, buffer + (size_t)b * BLOCK_SIZE)) < 0)
+            {
+                bad = bad < 0 ? b : bad;
+            }
+        }
+
+        /*Remembers the frame lengths read, and counts the bad blocks*/
+        pthread_mutex_lock(&lock);
+        for (b = 0; b < i && n >= 0; b++)
+        {
+            if (length[b] > 0)
+            {
+                extent[start_address + b] = (unsigned short)length[b];
+            }
+            else if (length[b] < 0)
+            {
+                stats.bad_blocks++;
+            }
+        }
+        pthread_mutex_unlock(&lock);
+    }
+    free(slots);
+    free(length);
+
+    if (bad >= 0)
+    {
+        printf("checksum error at block %d\n", start_address + bad);
+        return -1;
+    }
+    if (n < 0 || i < nblocks)
+    {
+        printf("%s error at block %d\n", write ? "write" : "read", start_address + i);
+        return -1;
+    }
+    return i;
+}
 
-    /*Sets up a temporary buffer*/
-    void *blockRead = (void *)malloc(BLOCK_SIZE);
+/*------------------------------------------------------------------*/
+/*Charges the device model for a request and moves its data with    */
+/*pread/pwrite, so concurrent requests do not share a file position */
+/*------------------------------------------------------------------*/
+static int transfer(int write, int start_address, int nblocks, void *buffer)
+{
+    int i, b, unwritten = 1;
+    ssize_t n;
 
-    /*Checks that the data requested is within the range of addresses of the disk*/
-    if (start_address + nblocks > MAX_BLOCK)
+    /*Checks that a disk is open and that the data requested is within the*/
+    /*range of addresses of the disk*/
+    if (fd == -1 || written == NULL)
+    {
+        printf("no disk open\n");
+        return -1;
+    }
+    if (start_address < 0 || start_address + nblocks > MAX_BLOCK)
     {
         printf("out of bound error %d\n", start_address);
         return -1;
     }
+    if (codec)
+    {
+        return transfer_frames(write, start_address, nblocks, (char *)buffer);
+    }
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    /*The device has a single head: model time is charged one request at a time*/
+    pthread_mutex_lock(&lock);
+    if (write)
+    {
+        stats.write_calls++;
+        stats.blocks_written += nblocks;
+    }
+    else
+    {
+        stats.read_calls++;
+        stats.blocks_read += nblocks;
+    }
+    seek_to(start_address);
 
-    /*For every block requested*/
+    /*For every block requested, pause until the transfer time is elapsed*/
     for (i = 0; i < nblocks; ++i)
     {
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer + (i * BLOCK_SIZE), blockRead, BLOCK_SIZE);
+        if (transfer_block(BLOCK_SIZE) < 0)
+        {
+            break;
+        }
+    }
+    if (write)
+    {
+        stats.bytes_written += (long)i * BLOCK_SIZE;
+    }
+    else
+    {
+        stats.bytes_read += (long)i * BLOCK_SIZE;
+    }
+
+    /*Tracks which blocks have been written since the disk was formatted*/
+    for (b = start_address; b < start_address + i; b++)
+    {
+        if (write)
+        {
+            written[b / 8] |= 1 << (b % 8);
+        }
+        else if (written[b / 8] & (1 << (b % 8)))
+        {
+            unwritten = 0;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    /*Moves the blocks transferred before any failure*/
+    if (write)
+    {
+        n = pwrite(fd, buffer, (size_t)i * BLOCK_SIZE, (off_t)start_address * BLOCK_SIZE);
+    }
+    else if (unwritten)
+    {
+        /*Never written since the format: implicitly 0's, no need to read*/
+        memset(buffer, 0, (size_t)i * BLOCK_SIZE);
+        n = 0;
+    }
+    else
+    {
+        n = pread(fd, buffer, (size_t)i * BLOCK_SIZE, (off_t)start_address * BLOCK_SIZE);
     }
 
-    free(blockRead);
-    return s;
+    if (n < 0 || i < nblocks)
+    {
+        printf("%s error at block %d\n", write ? "write" : "read", start_address + i);
+        return -1;
+    }
+    return i;
+}
+
+/*-------------------------------------------------------------------*/
+/*Reads a series of blocks from the disk into the buffer             */
+/*-------------------------------------------------------------------*/
+int read_blocks(int start_address, int nblocks, void *buffer)
+{
+    return transfer(0, start_address, nblocks, buffer);
 }
 
 /*------------------------------------------------------------------*/
@@ -110,33 +776,256 @@ int read_blocks(int start_address, int nblocks, void *buffer)
 /*------------------------------------------------------------------*/
 int write_blocks(int start_address, int nblocks, void *buffer)
 {
-    int i, s;
-    s = 0;
+    return transfer(1, start_address, nblocks, buffer);
+}
 
-    void *blockWrite = (void *)malloc(BLOCK_SIZE);
+/*------------------------------------------------------------------*/
+/*Runs a request and hands it to its callback or the completion     */
+/*queue. Called with aio_lock held, returns with it held            */
+/*------------------------------------------------------------------*/
+static void complete(struct disk_request *req)
+{
+    pthread_mutex_unlock(&aio_lock);
+    req->result = transfer(req->write, req->start_address, req->nblocks, req->buffer);
+    pthread_mutex_lock(&aio_lock);
 
-    /* Checks that the data requested is within the range of addresses of the disk */
-    if (start_address + nblocks > MAX_BLOCK)
+    inflight--;
+    if (req->callback != NULL)
     {
-        printf("out of bound error\n");
-        return -1;
+        /*The callback owns the request from now on and may submit more*/
+        pthread_mutex_unlock(&aio_lock);
+        req->callback(req);
+        pthread_mutex_lock(&aio_lock);
+    }
+    else
+    {
+        req->next = NULL;
+        if (completed_tail != NULL)
+        {
+            completed_tail->next = req;
+        }
+        else
+        {
+            completed_head = req;
+        }
+        completed_tail = req;
+        req->done = 1;
     }
+    pthread_cond_broadcast(&aio_done);
+}
 
-    /*Goto where the data is to be written on the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+/*------------------------------------------------------------------*/
+/*Takes the next pending request, letting the scheduler choose among */
+/*the first queue_depth of them. Called with aio_lock held           */
+/*------------------------------------------------------------------*/
+static struct disk_request *take_pending()
+{
+    struct disk_request *window[AIO_WINDOW];
+    struct disk_request *req, **link;
+    int n = 0, depth, i;
 
-    /*For every block requested*/
-    for (i = 0; i < nblocks; ++i)
+    depth = model.queue_depth < AIO_WINDOW ? model.queue_depth : AIO_WINDOW;
+    for (req = pending_head; req != NULL && n < depth; req = req->next)
+    {
+        window[n++] = req;
+    }
+    if (n == 0)
+    {
+        window[n++] = pending_head;
+    }
+
+    pthread_mutex_lock(&lock);
+    i = disk_pick(window, n);
+    pthread_mutex_unlock(&lock);
+
+    /*Unlinks the chosen request*/
+    for (link = &pending_head; *link != window[i]; link = &(*link)->next)
+        ;
+    *link = window[i]->next;
+    if (pending_tail == window[i])
+    {
+        pending_tail = NULL;
+        for (req = pending_head; req != NULL; req = req->next)
+        {
+            pending_tail = req;
+        }
+    }
+    return window[i];
+}
+
+/*--------------------------------------------------*/
+/*I/O worker: serves pending requests until shutdown */
+/*--------------------------------------------------*/
+static void *aio_worker(void *arg)
+{
+    struct disk_request *req;
+
+    pthread_mutex_lock(&aio_lock);
+    while (1)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
+        while (pending_head == NULL && !aio_stop)
+        {
+            pthread_cond_wait(&aio_work, &aio_lock);
+        }
+        if (pending_head == NULL)
+        {
+            break; /*stopping and drained*/
+        }
+        req = take_pending();
+        complete(req);
+    }
+    pthread_mutex_unlock(&aio_lock);
+    return NULL;
+}
 
-        memcpy(blockWrite, (char *)buffer + (i * BLOCK_SIZE), BLOCK_SIZE);
+/*------------------------------------------------------------------*/
+/*Starts n I/O workers for disk_submit. Without workers, requests   */
+/*are served inline by disk_submit                                  */
+/*------------------------------------------------------------------*/
+int disk_aio_init(int n)
+{
+    int i;
+
+    if (nworkers > 0 || n <= 0)
+    {
+        return 0;
+    }
+    workers = (pthread_t *)malloc(sizeof(pthread_t) * n);
+    aio_stop = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (pthread_create(&workers[i], NULL, aio_worker, NULL) != 0)
+        {
+            printf("Could not start I/O worker %d\n", i);
+            break;
+        }
+    }
+    nworkers = i;
+    return nworkers > 0 ? 0 : -1;
+}
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
+/*--------------------------------------------------------------*/
+/*Serves the pending requests, then stops and joins the workers */
+/*--------------------------------------------------------------*/
+void disk_aio_shutdown()
+{
+    int i;
+
+    pthread_mutex_lock(&aio_lock);
+    aio_stop = 1;
+    pthread_cond_broadcast(&aio_work);
+    pthread_mutex_unlock(&aio_lock);
+
+    for (i = 0; i < nworkers; i++)
+    {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Queues a request. On completion, req->callback is called from an  */
+/*I/O worker if set; otherwise the request is reaped by disk_poll or */
+/*disk_wait. The request must stay valid until then                 */
+/*------------------------------------------------------------------*/
+int disk_submit(struct disk_request *req)
+{
+    pthread_mutex_lock(&aio_lock);
+    req->done = 0;
+    req->next = NULL;
+    inflight++;
+
+    if (nworkers == 0)
+    {
+        complete(req);
+    }
+    else
+    {
+        pthread_mutex_lock(&lock);
+        req->submitted = clock_us;
+        pthread_mutex_unlock(&lock);
+
+        if (pending_tail != NULL)
+        {
+            pending_tail->next = req;
+        }
+        else
+        {
+            pending_head = req;
+        }
+        pending_tail = req;
+        pthread_cond_signal(&aio_work);
+    }
+    pthread_mutex_unlock(&aio_lock);
+    return 0;
+}
+
+/*------------------------------------------------------------------*/
+/*Reaps between min and max completed requests into done[], waiting */
+/*for completions while fewer than min are available. Returns the   */
+/*number reaped (less than min only if nothing is left in flight)   */
+/*------------------------------------------------------------------*/
+int disk_poll(struct disk_request **done, int min, int max)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&aio_lock);
+    while (n < max)
+    {
+        if (completed_head == NULL)
+        {
+            if (n >= min || inflight == 0)
+            {
+                break;
+            }
+            pthread_cond_wait(&aio_done, &aio_lock);
+            continue;
+        }
+        done[n] = completed_head;
+        completed_head = completed_head->next;
+        if (completed_head == NULL)
+        {
+            completed_tail = NULL;
+        }
+        done[n++]->next = NULL;
+    }
+    pthread_mutex_unlock(&aio_lock);
+    return n;
+}
+
+/*------------------------------------------------------------------*/
+/*Waits for one request (without a callback) and reaps it. Returns  */
+/*its result                                                        */
+/*------------------------------------------------------------------*/
+int disk_wait(struct disk_request *req)
+{
+    struct disk_request **link, *r;
+
+    pthread_mutex_lock(&aio_lock);
+    while (!req->done)
+    {
+        pthread_cond_wait(&aio_done, &aio_lock);
+    }
+
+    /*Unlinks it from the completion queue if disk_poll has not*/
+    for (link = &completed_head; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == req)
+        {
+            *link = req->next;
+            if (completed_tail == req)
+            {
+                completed_tail = NULL;
+                for (r = completed_head; r != NULL; r = r->next)
+                {
+                    completed_tail = r;
+                }
+            }
+            break;
+        }
     }
-    free(blockWrite);
-    return s;
+    pthread_mutex_unlock(&aio_lock);
+    return req->result;
 }
@@ -1,5 +1,84 @@
+#ifndef DISK_EMU_H
+#define DISK_EMU_H
+
+/* counters of block I/O issued against the emulated disk */
+struct disk_stats
+{
+    long read_calls;     // number of read_blocks() calls
+    long write_calls;    // number of write_blocks() calls
+    long blocks_read;    // total blocks transferred by read_blocks()
+    long blocks_written; // total blocks transferred by write_blocks()
+    long seeks;          // head movements charged by the device model
+    long failures;       // injected transfer failures (each one is retried)
+    long bytes_read;     // bytes moved off the media (frames when a codec is set)
+    long bytes_written;  // bytes moved to the media
+    long bad_blocks;     // blocks failing their checksum or frame check on read
+    double busy_us;      // modeled device time, in microseconds
+};
+
+/* device model: cost of a request = seek + nblocks * transfer */
+#define DISK_SCHED_FIFO 0     // serve requests in submission order
+#define DISK_SCHED_ELEVATOR 1 // sweep the head up and down (LOOK)
+#define DISK_SCHED_DEADLINE 2 // elevator, but overdue requests go first
+
+struct disk_model
+{
+    double seek_us;           // fixed cost of moving the head (settle + rotation)
+    double seek_us_per_block; // extra cost per block of distance
+    double max_seek_us;       // full stroke seek, 0: unbounded
+    double transfer_us;       // time to transfer one block
+    int queue_depth;          // requests the scheduler can choose from
+    int scheduler;            // DISK_SCHED_*
+    double deadline_us;       // DISK_SCHED_DEADLINE: max wait in the queue
+    double fail_prob;         // probability that a block transfer fails
+    int max_retry;            // retries of a failed transfer before an I/O error
+    int sleep;                // 1: sleep for the modeled time, 0: only account it
+};
+
+/* optional per-block codec, select it before init_disk/init_fresh_disk:
+ * every block is stored as a frame (header + payload) in a slot of
+ * block_size + DISK_FRAME_HEADER bytes, and only the frame is transferred */
+#define DISK_CODEC_CRC 1      // CRC32C of the block, verified on every read
+#define DISK_CODEC_LZ 2       // LZ4-style compression, raw if it does not shrink
+#define DISK_FRAME_HEADER 8   // crc (4 bytes), payload length (2), flags (2)
+
+/* one block request for disk_io_batch() and disk_submit() */
+struct disk_request
+{
+    int write;         // 0: read_blocks, 1: write_blocks
+    int start_address;
+    int nblocks;
+    void *buffer;
+    int result;        // return value of read_blocks/write_blocks
+    double submitted;  // modeled time the request entered the queue
+
+    // asynchronous requests only
+    void (*callback)(struct disk_request *req); // run by an I/O worker on completion, or NULL
+    void *arg;                                  // for the caller/callback, untouched by disk_emu
+    int done;                                   // set once completed (requests without callback)
+    struct disk_request *next;                  // queue link, owned by disk_emu
+};
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
 int close_disk();
+
+void disk_get_stats(struct disk_stats *stats);
+void disk_reset_stats();
+
+void disk_set_model(const struct disk_model *model);
+int disk_set_profile(const char *name); // "none" (default), "hdd", "ssd", "hdd-deadline"
+int disk_set_codec(const char *name);   // "none" (default), "crc", "lz", "lz+crc"
+int disk_pick(struct disk_request **queue, int n);
+int disk_io_batch(struct disk_request *reqs, int n);
+
+/* asynchronous block I/O: submit requests, then poll or wait for them */
+int disk_aio_init(int nworkers); // without workers, disk_submit() completes inline
+void disk_aio_shutdown();
+int disk_submit(struct disk_request *req);
+int disk_poll(struct disk_request **done, int min, int max);
+int disk_wait(struct disk_request *req);
+
+#endif
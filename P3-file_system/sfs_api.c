@@ -1,32 +1,52 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
 #include "sfs_api.h"
 #include "disk_emu.h"
 
 #define BLOCKSIZE 1024
-#define NUM_BLOCKS 1024
-#define NUMDATABLOCKS 1020
-#define MAXFILENAME 32 // change to 20 if following the pdf
+#ifndef NUM_BLOCKS
+#define NUM_BLOCKS 1024 // build with -DNUM_BLOCKS=... for larger images
+#endif
+#ifndef NUMINODES
+#define NUMINODES 256 // root directory + files
+#endif
+#define MAXFILENAME SFS_MAXFILENAME // in sfs_api.h, change to 20 if following the pdf
+#define IOWORKERS 4    // disk_emu I/O workers serving multi-block reads
+#define FSCKTHREADS 16 // most threads scanning the i-Node table in sfs_fsck
+#define MAGIC 0xACBD0008
+#define MAXREFS 255 // files sharing one block, the limit of a reference count byte
+
+/* bounded in memory caches, loaded on demand */
+#define METACACHESIZE 16 // i-Node table and directory blocks
+#define NAMECACHESIZE 64 // file name => directory index, including misses
 
 /* global variables */
-int currentposition = -1; // current position in directory => sfs_getnextfile()
+struct sfs_dir nextfile; // directory cursor of sfs_getnextfilename()
 
 /* on disk data structures
  * addresses:
  * super block: 0
- * i-Node table: 1
- * directory: 2
- * free byte map: 3
- * data blocks: 4~1023 (1020 data blocks) */
+ * i-Node table: 1 ~ INODETABLELENGTH
+ * directory: DIRECTORYSTART (DIRECTORYLENGTH blocks), packed: the root i-Node's
+ *   size entries are used, the rest are free
+ * free byte map: FREEMAPSTART (FREEMAPLENGTH blocks), a reference count per data block
+ * data blocks: DATASTART ~ NUM_BLOCKS - 1 (NUMDATABLOCKS data blocks)
+ * with the default geometry: 32 + 12 + 1 metadata blocks, 978 data blocks */
 
 struct superblock
 {
-    int magic;            // 0xACBD0005
+    int magic;            // MAGIC
     int blocksize;        // 1024
     int fssize;           // # blks
     int inodetablelength; // # blks
     int rootinode;        // i-Node#
+    int numinodes;        // # i-Nodes
+    int directorylength;  // # blks
+    int freemaplength;    // # blks
+    int datastart;        // address of the first data block
 } super;
 
 struct inode
@@ -34,21 +54,66 @@ struct inode
     int size;       // file size (in bytes)
     int direct[12]; // 12 pointers to data blocks
     int indirect;   // index of an index block
+    int tail[16];   // only used by inline data
     int occupied;   // same as "available" of directory entry
+    int inlined;    // 1: the data is stored from direct[] to tail[], no data blocks
 };
 
+// small files live in their i-Node: direct[], indirect and tail[] hold the
+// bytes, so reading them costs no data block I/O and no data block is used
+#define INLINESIZE (int)(offsetof(struct inode, occupied) - offsetof(struct inode, direct))
+#define INLINEDATA(node) ((char *)(node)->direct)
+
 struct direntry
 {
-    char *filename;
+    char filename[MAXFILENAME + 1];
     int inodenumber;
     int occupied;
 };
 
+#define INODESPERBLOCK (int)(BLOCKSIZE / sizeof(struct inode))
+#define INODETABLELENGTH ((NUMINODES + INODESPERBLOCK - 1) / INODESPERBLOCK)
+#define DIRENTRIESPERBLOCK (int)(BLOCKSIZE / sizeof(struct direntry))
+#define DIRECTORYLENGTH ((NUMINODES + DIRENTRIESPERBLOCK - 1) / DIRENTRIESPERBLOCK)
+#define NUMDIRENTRIES (DIRECTORYLENGTH * DIRENTRIESPERBLOCK)
+#define DIRECTORYSTART (1 + INODETABLELENGTH)
+#define FREEMAPSTART (DIRECTORYSTART + DIRECTORYLENGTH)
+#define FREEMAPLENGTH ((NUM_BLOCKS + BLOCKSIZE - 1) / BLOCKSIZE)
+#define DATASTART (FREEMAPSTART + FREEMAPLENGTH)
+#define NUMDATABLOCKS (NUM_BLOCKS - DATASTART)
+
 /* in memory data structures (cache) */
 struct superblock supercache;
-struct inode inodetablecache[NUMDATABLOCKS];
-struct direntry directorycache[NUMDATABLOCKS];
-unsigned char freebytemapcache[NUMDATABLOCKS]; // 'E': empty; 'F': full
+// free byte map: number of i-Nodes / index blocks pointing to each data block,
+// 0: free, more than 1: shared by clones, copied on write (first NUMDATABLOCKS bytes)
+unsigned char refcountcache[FREEMAPLENGTH * BLOCKSIZE];
+unsigned char freemapdirty[FREEMAPLENGTH]; // free byte map blocks to write back
+// data blocks being read or written without the caller's lock (see sfs_setlock):
+// a block freed meanwhile is not handed out again until its I/O completed
+unsigned char busyblocks[NUM_BLOCKS];
+pthread_mutex_t *callerlock = NULL; // see sfs_setlock
+
+// i-Node table and directory blocks, write-through, least recently used is evicted
+struct cacheblock
+{
+    int address; // disk address, 0: slot empty
+    unsigned int lastuse;
+    char data[BLOCKSIZE];
+};
+struct cacheblock metacache[METACACHESIZE];
+unsigned int metaclock = 0;
+
+// file name lookups, index -1 remembers that the name is not in the directory
+struct nameentry
+{
+    int valid;
+    char name[MAXFILENAME + 1];
+    int index;
+};
+struct nameentry namecache[NAMECACHESIZE];
+
+// where the next free i-Node search starts
+int inodehint = 1;
 
 struct oftentry
 {
@@ -56,85 +121,420 @@ struct oftentry
     int inode;
     int rwpointer;
 };
-struct oftentry openfiletable[NUMDATABLOCKS];
+struct oftentry openfiletable[NUMINODES]; // index = fileID
+
+int allocblock();
+
+/* cache functions */
+
+/* returns the cached copy of a metadata block, reading it on a miss,
+ * NULL if it cannot be read. The pointer is only valid until the next call */
+char *getblock(int address)
+{
+    int victim = 0;
+    for (int i = 0; i < METACACHESIZE; i++)
+    {
+        if (metacache[i].address == address)
+        {
+            metacache[i].lastuse = ++metaclock;
+            return metacache[i].data;
+        }
+        if (metacache[i].lastuse < metacache[victim].lastuse)
+            victim = i;
+    }
+    // a failed read must not leave the victim tagged with the new address
+    metacache[victim].address = 0;
+    if (read_blocks(address, 1, metacache[victim].data) < 0)
+        return NULL;
+    metacache[victim].address = address;
+    metacache[victim].lastuse = ++metaclock;
+    return metacache[victim].data;
+}
+
+/* the i-Node and directory accessors return -1 if the block cannot be read,
+ * reads then fill the result with 0's */
+int readinode(int inodenumber, struct inode *node)
+{
+    char *block = getblock(1 + inodenumber / INODESPERBLOCK);
+    if (block == NULL)
+    {
+        memset(node, 0, sizeof(struct inode));
+        return -1;
+    }
+    memcpy(node, block + (inodenumber % INODESPERBLOCK) * sizeof(struct inode), sizeof(struct inode));
+    return 0;
+}
+
+int writeinode(int inodenumber, struct inode *node)
+{
+    int address = 1 + inodenumber / INODESPERBLOCK;
+    char *block = getblock(address);
+    if (block == NULL)
+        return -1;
+    memcpy(block + (inodenumber % INODESPERBLOCK) * sizeof(struct inode), node, sizeof(struct inode));
+    return write_blocks(address, 1, block) < 0 ? -1 : 0;
+}
+
+int readdirentry(int index, struct direntry *entry)
+{
+    char *block = getblock(DIRECTORYSTART + index / DIRENTRIESPERBLOCK);
+    if (block == NULL)
+    {
+        memset(entry, 0, sizeof(struct direntry));
+        return -1;
+    }
+    memcpy(entry, block + (index % DIRENTRIESPERBLOCK) * sizeof(struct direntry), sizeof(struct direntry));
+    return 0;
+}
+
+int writedirentry(int index, struct direntry *entry)
+{
+    int address = DIRECTORYSTART + index / DIRENTRIESPERBLOCK;
+    char *block = getblock(address);
+    if (block == NULL)
+        return -1;
+    memcpy(block + (index % DIRENTRIESPERBLOCK) * sizeof(struct direntry), entry, sizeof(struct direntry));
+    return write_blocks(address, 1, block) < 0 ? -1 : 0;
+}
+
+struct nameentry *nameslot(const char *name)
+{
+    unsigned int hash = 5381;
+    for (const char *c = name; *c; c++)
+        hash = hash * 33 + (unsigned char)*c;
+    return &namecache[hash % NAMECACHESIZE];
+}
+
+void namecacheset(const char *name, int index)
+{
+    struct nameentry *slot = nameslot(name);
+    slot->valid = 1;
+    strcpy(slot->name, name);
+    slot->index = index;
+}
+
+/* returns the directory index of a file, -1 if there is no such file */
+int lookup(const char *name)
+{
+    if (strlen(name) > MAXFILENAME)
+        return -1;
+
+    struct nameentry *slot = nameslot(name);
+    if (slot->valid && strcmp(slot->name, name) == 0)
+        return slot->index; // hit, possibly negative
+
+    // miss: scan the used part of the directory, loading its blocks as needed
+    int index = -1;
+    struct direntry entry;
+    struct inode root;
+    int failed = readinode(0, &root);
+    for (int i = 0; i < root.size; i++)
+    {
+        if (readdirentry(i, &entry) == -1)
+            failed = -1;
+        else if (strcmp(entry.filename, name) == 0)
+        {
+            index = i;
+            break;
+        }
+    }
+    // a miss is only remembered if the whole directory could be read
+    if (index != -1 || failed == 0)
+        namecacheset(name, index);
+    return index;
+}
+
+void flushfreemap()
+{
+    for (int i = 0; i < FREEMAPLENGTH; i++)
+    {
+        if (freemapdirty[i])
+        {
+            write_blocks(FREEMAPSTART + i, 1, &refcountcache[i * BLOCKSIZE]);
+            freemapdirty[i] = 0;
+        }
+    }
+}
+
+int refcount(int address)
+{
+    return refcountcache[address - DATASTART];
+}
+
+void setrefcount(int address, int count)
+{
+    refcountcache[address - DATASTART] = count;
+    freemapdirty[(address - DATASTART) / BLOCKSIZE] = 1;
+}
+
+/* drops one reference to a data block, the last one frees it */
+void unrefblock(int address)
+{
+    setrefcount(address, refcount(address) - 1);
+}
+
+/* runs the data block I/O of reqs without the caller's lock, so that the
+ * disk waits of different callers overlap. Returns -1 if a request failed */
+int dataio(int write, struct disk_request *reqs, int nreqs)
+{
+    for (int i = 0; i < nreqs; i++)
+    {
+        for (int b = 0; b < reqs[i].nblocks; b++)
+            busyblocks[reqs[i].start_address + b]++;
+    }
+    if (callerlock != NULL)
+        pthread_mutex_unlock(callerlock);
+
+    // issue every request before waiting so that the I/O workers overlap them
+    // (a single request is cheaper to serve in place)
+    int failed = 0;
+    if (nreqs == 1 && write)
+        failed = write_blocks(reqs[0].start_address, reqs[0].nblocks, reqs[0].buffer) < 0;
+    else if (nreqs == 1)
+        failed = read_blocks(reqs[0].start_address, reqs[0].nblocks, reqs[0].buffer) < 0;
+    else
+    {
+        for (int i = 0; i < nreqs; i++)
+        {
+            reqs[i].write = write;
+            disk_submit(&reqs[i]);
+        }
+        for (int i = 0; i < nreqs; i++)
+        {
+            if (disk_wait(&reqs[i]) < 0)
+                failed = 1;
+        }
+    }
+
+    if (callerlock != NULL)
+        pthread_mutex_lock(callerlock);
+    for (int i = 0; i < nreqs; i++)
+    {
+        for (int b = 0; b < reqs[i].nblocks; b++)
+            busyblocks[reqs[i].start_address + b]--;
+    }
+    return failed ? -1 : 0;
+}
+
+/* adds block address, holding buffer, to the requests: merged into the last one
+ * if it continues it on disk and in memory */
+int addrequest(struct disk_request *reqs, int nreqs, int address, char *buffer)
+{
+    if (nreqs > 0 && reqs[nreqs - 1].start_address + reqs[nreqs - 1].nblocks == address &&
+        (char *)reqs[nreqs - 1].buffer + reqs[nreqs - 1].nblocks * BLOCKSIZE == buffer)
+    {
+        reqs[nreqs - 1].nblocks++;
+        return nreqs;
+    }
+    reqs[nreqs].start_address = address;
+    reqs[nreqs].nblocks = 1;
+    reqs[nreqs].buffer = buffer;
+    return nreqs + 1;
+}
 
 /* sfs functions */
 
+void sfs_setlock(pthread_mutex_t *lock)
+{
+    callerlock = lock;
+}
+
 void mksfs(int fresh)
 {
+    // start from empty in memory tables
+    memset(metacache, 0, sizeof(metacache));
+    memset(namecache, 0, sizeof(namecache));
+    memset(openfiletable, 0, sizeof(openfiletable));
+    memset(freemapdirty, 0, sizeof(freemapdirty));
+    memset(&supercache, 0, sizeof(supercache)); // no file system until one is mounted
+    metaclock = 0;
+    inodehint = 1;
+    sfs_opendir(&nextfile);
+
+    char block[BLOCKSIZE] = {0};
     if (fresh == 0)
     {
         // open fs from existing disk
-        init_disk("disk", BLOCKSIZE, NUM_BLOCKS);
+        if (init_disk("disk", BLOCKSIZE, NUM_BLOCKS) == -1)
+            return;
+        disk_aio_init(IOWORKERS);
+
+        // only the super block and the free byte map are loaded now,
+        // i-Nodes and directory blocks are read when first used
+        if (read_blocks(0, 1, block) < 0)
+            return;
+        memcpy(&super, block, sizeof(super));
+        if (super.magic != MAGIC || super.blocksize != BLOCKSIZE || super.fssize != NUM_BLOCKS ||
+            super.numinodes != NUMINODES || super.datastart != DATASTART)
+        {
+            printf("disk does not hold a file system with this geometry\n");
+            return;
+        }
+        memcpy(&supercache, &super, sizeof(super));
+        read_blocks(FREEMAPSTART, FREEMAPLENGTH, refcountcache);
     }
     else
     {
         // create new fs: initialize new disk
-        init_fresh_disk("disk", BLOCKSIZE, NUM_BLOCKS);
+        if (init_fresh_disk("disk", BLOCKSIZE, NUM_BLOCKS) == -1)
+            return;
+        disk_aio_init(IOWORKERS);
 
         // initialize the super block
-        super.magic = 0xACBD0005;
+        super.magic = MAGIC;
         super.blocksize = BLOCKSIZE;
         super.fssize = NUM_BLOCKS;
-        super.inodetablelength = NUMDATABLOCKS;
-        super.rootinode = 0;                    // the first i-Node is the directory
-        write_blocks(0, 1, &super);             // write super block to disk (first data block)
-        memcpy(&supercache, &super, BLOCKSIZE); // cache super block in memory
+        super.inodetablelength = INODETABLELENGTH;
+        super.rootinode = 0; // the first i-Node is the directory
+        super.numinodes = NUMINODES;
+        super.directorylength = DIRECTORYLENGTH;
+        super.freemaplength = FREEMAPLENGTH;
+        super.datastart = DATASTART;
+        memcpy(block, &super, sizeof(super));
+        write_blocks(0, 1, block);                  // write super block to disk (first data block)
+        memcpy(&supercache, &super, sizeof(super)); // cache super block in memory
 
         // inode of the root directory
-        inodetablecache[0].occupied = 1;
-        inodetablecache[0].size = 0; // = # files = # directory entries
-
-        // initialize i-Node table
-        write_blocks(1, 1, inodetablecache);
+        struct inode root = {0};
+        root.occupied = 1;
+        root.size = 0; // = # files = # directory entries
+        writeinode(0, &root);
 
-        // initialize directory
-        write_blocks(2, 1, directorycache);
+        // the rest of the i-Node table and the directory are never-written
+        // blocks, which the disk reads as 0's (free)
 
         // initialize free byte map
-        for (int i = 0; i < NUMDATABLOCKS; i++)
-        {
-            freebytemapcache[i] = 'E'; // initialize all blocks to be free
-        }
-        write_blocks(3, 1, freebytemapcache);
+        memset(refcountcache, 0, sizeof(refcountcache)); // initialize all blocks to be free
+        memset(freemapdirty, 1, sizeof(freemapdirty));
+        flushfreemap();
+
+        // data blocks are not written: the disk reads never-written blocks as 0's
+    }
+}
+
+void sfs_opendir(struct sfs_dir *dir)
+{
+    dir->position = 0;
+}
+
+/* copies up to max entries (name and size) from the cursor on into entries
+ * and moves the cursor past them, returns how many, 0 at the end. The
+ * directory is packed, so a listing reads each directory block once.
+ * a remove during the listing moves the last entry into the freed slot:
+ * that entry is missed if the cursor is already past the slot */
+int sfs_readdir(struct sfs_dir *dir, struct sfs_dirent *entries, int max)
+{
+    struct inode root, node;
+    struct direntry entry;
+    readinode(0, &root);
 
-        // initialize datablocks
-        char datablocks[BLOCKSIZE * NUMDATABLOCKS];
-        write_blocks(4, NUMDATABLOCKS, datablocks);
+    int n = 0;
+    for (; n < max && dir->position < root.size; n++, dir->position++)
+    {
+        readdirentry(dir->position, &entry);
+        readinode(entry.inodenumber, &node);
+        strcpy(entries[n].name, entry.filename);
+        entries[n].size = node.size;
     }
+    return n;
 }
 
+/* copies the name of the next file into fname and returns 0, or returns -1
+ * once every file was listed (the next call starts over) */
 int sfs_getnextfilename(char *fname)
 {
-    for (int i = currentposition; i < NUMDATABLOCKS - 1; i++)
-    {                                                      // i = -1 : 1022
-        currentposition++;                                 // cp = 0 : 1023
-        if (directorycache[currentposition].occupied == 1) // file available
+    // names only: no i-Node reads, unlike sfs_readdir
+    struct inode root;
+    struct direntry entry;
+    readinode(0, &root);
+    if (nextfile.position >= root.size)
+    {
+        sfs_opendir(&nextfile);
+        return -1;
+    }
+    readdirentry(nextfile.position++, &entry);
+    strcpy(fname, entry.filename);
+    return 0;
+}
+
+int sfs_getfilesize(const char *path)
+{
+    // find the directory entry of the file with the same name
+    int index = lookup(path);
+    if (index == -1)
+    {
+        printf("file not found\n");
+        return -1;
+    }
+    // directory entry => i-Node number => i-Node => size
+    struct direntry entry;
+    struct inode node;
+    readdirentry(index, &entry);
+    readinode(entry.inodenumber, &node);
+    return node.size;
+}
+
+/* puts an i-Node into an empty entry of the open file table */
+int oftopen(int inodenumber, int rwpointer)
+{
+    for (int i = 0; i < NUMINODES; i++)
+    {
+        if (openfiletable[i].occupied == 0)
         {
-            fname = directorycache[currentposition].filename;
-            break;
+            openfiletable[i].occupied = 1;
+            openfiletable[i].inode = inodenumber;
+            openfiletable[i].rwpointer = rwpointer;
+            return i;
         }
     }
-    for (int j = currentposition + 1; j < NUMDATABLOCKS; j++)
-    {                                        // j = 1 : 1023
-        if (directorycache[j].occupied == 1) // if there is a next file in the directory
-            return 0;
-    }
-    // else: all files are returned, back to beginning of the directory
-    currentposition = -1;
+    printf("too many open files\n");
     return -1;
 }
 
-int sfs_getfilesize(const char *path)
+/* adds a file called fname with the given i-Node to the directory,
+ * returns its directory index (and i-Node number), -1 if the tables are full */
+int createfile(char *fname, struct inode *node, int *inodenumber)
 {
-    for (int i = 0; i < NUMDATABLOCKS; i++)
-    { // find the directory entry of the file with the same name
-        if (directorycache[i].occupied == 1 && directorycache[i].filename == path)
-            // directory entry => i-Node number => i-Node => size
-            return inodetablecache[directorycache[i].inodenumber].size;
+    // allocate an empty i-Node
+    struct inode slot;
+    *inodenumber = -1;
+    for (int n = 0; n < NUMINODES - 1; n++)
+    {
+        int i = 1 + (inodehint - 1 + n) % (NUMINODES - 1); // skip the root i-Node
+        // an unreadable i-Node is not free, it may be in use
+        if (readinode(i, &slot) == 0 && slot.occupied == 0)
+        {
+            *inodenumber = i;
+            break;
+        }
     }
-    printf("file not found\n");
-    return -1;
+
+    // the directory is packed: the new entry goes after the last one
+    struct direntry entry;
+    struct inode root;
+    if (readinode(0, &root) == -1)
+        return -1;
+    int index = root.size;
+    if (*inodenumber == -1 || index == NUMDIRENTRIES)
+    {
+        printf("no free i-Node or directory entry left\n");
+        return -1;
+    }
+    inodehint = *inodenumber + 1;
+
+    writeinode(*inodenumber, node);
+
+    memset(&entry, 0, sizeof(entry));
+    entry.occupied = 1;
+    strcpy(entry.filename, fname);
+    entry.inodenumber = *inodenumber;
+    writedirentry(index, &entry);
+    namecacheset(fname, index);
+
+    // one more entry in the root directory
+    root.size++;
+    writeinode(0, &root);
+    return index;
 }
 
 int sfs_fopen(char *fname)
@@ -146,321 +546,852 @@ int sfs_fopen(char *fname)
     }
 
     /* file exists */
-    for (int i = 0; i < NUMDATABLOCKS; i++)
+    int index = lookup(fname);
+    if (index != -1)
     {
-        if (directorycache[i].occupied == 1 && directorycache[i].filename == fname)
+        printf("\nOPEN EXISTING FILE : %s\n", fname);
+        // found the file from directory, get its i-Node number
+        struct direntry entry;
+        struct inode node;
+        if (readdirentry(index, &entry) == -1 || readinode(entry.inodenumber, &node) == -1)
+            return -1;
+        // put into the open file table
+        // default: set the r/w pointer at the end of the file
+        return oftopen(entry.inodenumber, node.size);
+    }
+
+    /* file does not exist: create new file */
+    printf("\nCREATE NEW FILE : %s\n", fname);
+
+    struct inode node = {0};
+    node.occupied = 1;
+    node.inlined = 1; // until it outgrows the i-Node
+    node.size = 0;
+    int inodenumber;
+    index = createfile(fname, &node, &inodenumber);
+    if (index == -1)
+        return -1;
+
+    // put into an empty entry in the open file table
+    return oftopen(inodenumber, 0); // index in the open file table = fileID
+}
+
+/* returns the i-Node number behind a fileID, -1 if it is not an open file */
+int openinode(int fileID)
+{
+    if (fileID < 0 || fileID >= NUMINODES || openfiletable[fileID].occupied != 1)
+        return -1;
+    return openfiletable[fileID].inode;
+}
+
+int sfs_fclose(int fileID)
+{
+    printf("\nCLOSE FILE %d\n", fileID);
+    if (openinode(fileID) == -1)
+    {
+        printf("file already closed\n");
+        return -1;
+    }
+    // remove the file from the open file table
+    openfiletable[fileID].occupied = 0;
+    return 0;
+}
+
+/* returns the disk address of the n-th block of a file (0: not allocated, or it cannot be)
+ * if allocate is set, the block is about to be written: missing data blocks
+ * (and the index block) are taken from the free byte map, and blocks shared
+ * with a clone are replaced by a private copy. *from is then the address
+ * holding the current content of the block (0: none)
+ * *indexblock must hold the file's index block */
+int fileblock(struct inode *node, int *indexblock, int n, int allocate, int *from)
+{
+    int *pointer;
+    if (n < 12)
+        pointer = &node->direct[n];
+    else if (n - 12 < BLOCKSIZE / sizeof(int))
+    {
+        if (node->indirect == 0)
         {
-            printf("\nOPEN EXISTING FILE : %s\n", fname);
-            // found the file from directory, get its i-Node number
-            int inodenumber = directorycache[i].inodenumber;
-            // put into the open file table
-            for (int j = 0; j < NUMDATABLOCKS; j++)
+            if (!allocate)
+                return 0;
+            // initialize the indirect index block
+            node->indirect = allocblock();
+            if (node->indirect == 0)
+                return 0;
+            memset(indexblock, 0, BLOCKSIZE);
+            write_blocks(node->indirect, 1, indexblock);
+        }
+        else if (allocate && refcount(node->indirect) > 1)
+        {
+            // the index block is shared: this file gets its own copy, which
+            // holds one more reference to each of the data blocks
+            for (int i = 0; i < BLOCKSIZE / sizeof(int); i++)
             {
-                // find an empty OFT entry
-                if (openfiletable[j].occupied == 0)
+                if (indexblock[i] != 0 && refcount(indexblock[i]) == MAXREFS)
                 {
-                    openfiletable[j].occupied = 1;
-                    openfiletable[j].inode = inodenumber;
-                    // default: set the r/w pointer at the end of the file
-                    openfiletable[j].rwpointer = inodetablecache[inodenumber].size;
-                    break;
+                    printf("block %d: too many copies to copy its index block\n", indexblock[i]);
+                    return 0;
                 }
             }
-            return i;
+            int copy = allocblock();
+            if (copy == 0)
+                return 0;
+            for (int i = 0; i < BLOCKSIZE / sizeof(int); i++)
+            {
+                if (indexblock[i] != 0)
+                    setrefcount(indexblock[i], refcount(indexblock[i]) + 1);
+            }
+            unrefblock(node->indirect);
+            node->indirect = copy;
+            write_blocks(node->indirect, 1, indexblock);
         }
+        pointer = &indexblock[n - 12];
     }
+    else
+        return 0; // beyond the largest file size
 
-    /* file does not exist: create new file */
-    printf("\nCREATE NEW FILE : %s\n", fname);
+    if (!allocate)
+        return *pointer;
 
-    // allocate an empty i-Node
-    int inodenumber;
-    for (int i = 0; i < NUMDATABLOCKS; i++)
+    *from = *pointer;
+    if (*pointer == 0 || refcount(*pointer) > 1)
     {
-        if (inodetablecache[i].occupied == 0)
+        // new block, or copy on write of a shared one
+        int address = allocblock();
+        if (address == 0)
+            return 0;
+        if (*pointer != 0)
+            unrefblock(*pointer);
+        *pointer = address;
+        if (n >= 12)
+            write_blocks(node->indirect, 1, indexblock);
+    }
+    return *pointer;
+}
+/* takes a block from the free byte map, returns its disk address (0: disk full) */
+int allocblock()
+{
+    for (int j = 0; j < NUMDATABLOCKS; j++)
+    {
+        if (refcountcache[j] == 0 && busyblocks[DATASTART + j] == 0) // find a free block to write
         {
-            inodenumber = i;
-            break;
+            setrefcount(DATASTART + j, 1);
+            return DATASTART + j;
         }
     }
-    inodetablecache[inodenumber].occupied = 1;
-    inodetablecache[inodenumber].size = 0;
-    write_blocks(1, 1, inodetablecache);
+    printf("no free data block left\n");
+    return 0;
+}
 
-    // assign an empty directory entry
-    int index;
-    for (int i = 0; i < NUMDATABLOCKS; i++)
+int sfs_fwrite(int fileID, const char *buffer, int length)
+{
+    printf("\nWRITE %d bytes TO FILE %d\n", length, fileID);
+    int inodenumber = openinode(fileID);
+    if (inodenumber == -1)
+    {
+        printf("file not open\n");
+        return -1;
+    }
+    struct inode node;
+    if (readinode(inodenumber, &node) == -1)
+        return -1;
+    int oft = fileID;
+    int wpointer = openfiletable[oft].rwpointer; // write from the rwpointer
+
+    int written = 0;
+    char buf[BLOCKSIZE]; // content of the block being written
+    int indexblock[BLOCKSIZE / sizeof(int)];
+    if (node.inlined)
     {
-        if (directorycache[i].occupied == 0)
+        if (wpointer + length <= INLINESIZE)
         {
-            index = i;
-            break;
+            // still fits in the i-Node: one metadata write
+            memcpy(INLINEDATA(&node) + wpointer, buffer, length);
+            openfiletable[oft].rwpointer = wpointer + length;
+            if (wpointer + length > node.size)
+                node.size = wpointer + length;
+            writeinode(inodenumber, &node);
+            return length;
+        }
+
+        // outgrows the i-Node: its data moves to the first data block
+        memset(buf, 0, BLOCKSIZE);
+        memcpy(buf, INLINEDATA(&node), node.size);
+        memset(INLINEDATA(&node), 0, INLINESIZE);
+        node.inlined = 0;
+        if (node.size > 0)
+        {
+            int from, address = fileblock(&node, indexblock, 0, 1, &from);
+            if (address == 0)
+                return 0; // disk full, the file stays inline
+            write_blocks(address, 1, buf);
         }
     }
-    directorycache[index].occupied = 1;
-    directorycache[index].filename = fname;
-    directorycache[index].inodenumber = inodenumber;
-    write_blocks(2, 1, directorycache);
+    else if (node.indirect != 0)
+        read_blocks(node.indirect, 1, indexblock); // read the indirect index block
 
-    // put into an empty entry in the open file table
-    int oftindex;
-    for (int i = 0; i < NUMDATABLOCKS; i++)
+    // allocate and map every block first, staging its new content; the data
+    // blocks are written once the metadata is
+    int first = wpointer / BLOCKSIZE;
+    int nblocks = length > 0 ? (wpointer + length - 1) / BLOCKSIZE - first + 1 : 0;
+    char *blocks = (char *)malloc(nblocks * BLOCKSIZE + 1);
+    struct disk_request *reqs = (struct disk_request *)calloc(nblocks + 1, sizeof(struct disk_request));
+    int nreqs = 0;
+    while (written < length)
     {
-        if (openfiletable[i].occupied == 0)
+        int offset = wpointer % BLOCKSIZE; // offset of wpointer in its block
+        int chunk = BLOCKSIZE - offset;    // bytes going to this block
+        if (chunk > length - written)
+            chunk = length - written;
+
+        int from;
+        int address = fileblock(&node, indexblock, wpointer / BLOCKSIZE, 1, &from);
+        if (address == 0)
+            break; // disk or file full
+
+        // keep the rest of a partially overwritten block (from the shared
+        // block it was copied from, after a copy on write)
+        char *block = &blocks[(wpointer / BLOCKSIZE - first) * BLOCKSIZE];
+        if (chunk < BLOCKSIZE)
         {
-            oftindex = i;
-            break;
+            if (from != 0 && wpointer - offset < node.size)
+                read_blocks(from, 1, block);
+            else
+                memset(block, 0, BLOCKSIZE);
         }
+        memcpy(&block[offset], &buffer[written], chunk);
+        nreqs = addrequest(reqs, nreqs, address, block);
+
+        written += chunk;
+        wpointer += chunk;
     }
-    openfiletable[oftindex].occupied = 1;
-    openfiletable[oftindex].inode = inodenumber;
-    openfiletable[oftindex].rwpointer = 0;
 
-    return index; // index in the directory = fileID
+    // update the r/w pointer and the file size in i-Node
+    openfiletable[oft].rwpointer = wpointer;
+    if (wpointer > node.size)
+        node.size = wpointer;
+
+    // flush cache back to disk
+    writeinode(inodenumber, &node);
+    flushfreemap();
+
+    dataio(1, reqs, nreqs);
+    free(reqs);
+    free(blocks);
+    return written;
 }
 
-int sfs_fclose(int fileID)
+int sfs_fread(int fileID, char *buffer, int length)
 {
-    printf("\nCLOSE FILE %d\n", fileID);
-    int inodenumber;
-    if (directorycache[fileID].occupied == 1)
-        // find the file in the directory and get its i-Node number
-        inodenumber = directorycache[fileID].inodenumber;
-    else
+    printf("\nREAD %d bytes FROM FILE %d\n", length, fileID);
+    int inodenumber = openinode(fileID);
+    if (inodenumber == -1)
     {
-        printf("file not in the directory\n");
+        printf("file not open\n");
         return -1;
     }
+    struct inode node;
+    if (readinode(inodenumber, &node) == -1)
+        return -1;
+    int oft = fileID;
+    int rpointer = openfiletable[oft].rwpointer; // read from the rwpointer
+    // reading does not move the rwpointer
 
-    for (int i = 0; i < NUMDATABLOCKS; i++)
+    if (length > node.size - rpointer)
+        length = node.size - rpointer; // stop at the end of the file
+    if (length <= 0)
+        return 0;
+    if (node.inlined)
     {
-        if (openfiletable[i].inode == inodenumber && openfiletable[i].occupied == 1)
-        { // remove the file from the open file table
-            openfiletable[i].occupied = 0;
-            return 0;
-        }
-        else
-        {
-            // printf("inodenumber = %d\n", openfiletable[i].inode);
-            // printf("occupied = %d\n", openfiletable[i].occupied);
-        }
+        memcpy(buffer, INLINEDATA(&node) + rpointer, length);
+        return length;
     }
-    printf("file already closed\n");
-    return -1;
-}
 
-int sfs_fwrite(int fileID, const char *buffer, int length)
-{
-    printf("\nWRITE %d bytes TO FILE %d\n", length, fileID);
-    int inodenumber = directorycache[fileID].inodenumber;
-    int wpointer; // write from the rwpointer
-    for (int i = 0; i < NUMDATABLOCKS; i++)
+    int indexblock[BLOCKSIZE / sizeof(int)]; // indirect index block
+    if (node.indirect != 0)
+        read_blocks(node.indirect, 1, indexblock);
+
+    // map the blocks to read, merging runs of contiguous blocks into one request
+    int first = rpointer / BLOCKSIZE;
+    int nblocks = (rpointer + length - 1) / BLOCKSIZE - first + 1;
+    char *blocks = (char *)malloc(nblocks * BLOCKSIZE);
+    struct disk_request *reqs = (struct disk_request *)calloc(nblocks, sizeof(struct disk_request));
+    int nreqs = 0, mapped;
+    for (mapped = 0; mapped < nblocks; mapped++)
     {
-        if (openfiletable[i].inode == inodenumber && openfiletable[i].occupied == 1)
-        {
-            wpointer = openfiletable[i].rwpointer;
-            openfiletable[i].rwpointer += length; // update the r/w pointer
+        // find the address of next block to read from the i-Node
+        int address = fileblock(&node, indexblock, first + mapped, 0, NULL);
+        if (address == 0) // pointer uninitialized
             break;
-        }
+        nreqs = addrequest(reqs, nreqs, address, &blocks[mapped * BLOCKSIZE]);
     }
+    int failed = dataio(0, reqs, nreqs) < 0;
 
-    // update file size in i-Node
-    inodetablecache[inodenumber].size += length;
+    int offset = rpointer % BLOCKSIZE; // offset within the first block to read
+    int done = mapped * BLOCKSIZE - offset;
+    if (done > length)
+        done = length;
+    if (done < 0)
+        done = 0;
+    memcpy(buffer, &blocks[offset], done);
 
-    // read the indirect index block
-    int indexblock[BLOCKSIZE / sizeof(int)];
-    read_blocks(inodetablecache[inodenumber].indirect, 1, indexblock);
+    free(reqs);
+    free(blocks);
+    return failed ? -1 : done;
+}
 
-    int fileblocks = wpointer / BLOCKSIZE; // # full data blocks occupied by the file
-    int address;                           // address of the last data block
-    if (fileblocks < 12)
-        address = inodetablecache[inodenumber].direct[fileblocks];
-    else
-        address = indexblock[fileblocks - 12];
+int sfs_fseek(int fileID, int loc)
+{
+    printf("\nSEEK TO LOCATION %d IN FILE %d\n", loc, fileID);
+    // find the i-Node number of the file
+    int inodenumber = openinode(fileID);
+    if (inodenumber == -1)
+    {
+        printf("file not open\n");
+        return -1;
+    }
+    struct inode node;
+    if (readinode(inodenumber, &node) == -1)
+        return -1;
+    int filesize = node.size;
 
-    int offset = wpointer % BLOCKSIZE; // offset of rwpointer in the last block
-    char buf[BLOCKSIZE];               // content from rwpointer of the last block
-    read_blocks(address, 1, buf);
-    char content[length + offset]; // total content to write to disk
-    strcpy(content, buf);
-    // append given buffer to content of the last block
-    for (int i = offset, j = 0; j < length; i++, j++)
+    // the end of the file is a valid position: the next write appends
+    if (loc > filesize)
     {
-        content[i] = buffer[j];
-        content[i + 1] = 0;
+        printf("given location larger than file size: %d\n", filesize);
+        return -1;
     }
 
-    int bufferblocks = (length + offset) / BLOCKSIZE + 1; // total number of blocks to write
+    // update r/w pointer in the open file table
+    openfiletable[fileID].rwpointer = loc;
+    return 0;
+}
 
-    for (int i = 0; i < bufferblocks; i++)
+/* moves directory entry from into slot to */
+void moveentry(int from, int to)
+{
+    struct direntry entry;
+    readdirentry(from, &entry);
+    writedirentry(to, &entry);
+    namecacheset(entry.filename, to);
+}
+
+int sfs_remove(char *file)
+{
+    int i = lookup(file);
+    if (i == -1)
     {
-        for (int j = 0; j < NUMDATABLOCKS; j++)
-        {
-            if (freebytemapcache[j] == 'E') // find a free block to write
-            {
-                freebytemapcache[j] = 'F';
+        // if no matching file with the given name
+        printf("file %s not found\n", file);
+        return -1;
+    }
 
-                // update i-Node pointer
-                if (fileblocks + i < 12)
-                    inodetablecache[inodenumber].direct[fileblocks + i] = j;
-                else
-                    indexblock[fileblocks + i - 12] = j;
+    // remove from directory, keeping it packed: the last entry moves into the hole
+    struct direntry entry;
+    struct inode root;
+    if (readinode(0, &root) == -1 || readdirentry(i, &entry) == -1)
+        return -1;
+    int inodenumber = entry.inodenumber;
+    int last = root.size - 1;
+    if (i < nextfile.position && nextfile.position <= last)
+    {
+        // sfs_getnextfilename passed the hole but not the last entry: the last
+        // entry it returned fills the hole, and the last entry takes its place,
+        // where the cursor moves back to
+        int seen = nextfile.position - 1;
+        if (i != seen)
+            moveentry(seen, i);
+        moveentry(last, seen);
+        nextfile.position--;
+    }
+    else if (i != last)
+        moveentry(last, i);
+    memset(&entry, 0, sizeof(entry));
+    writedirentry(last, &entry);
+    namecacheset(file, -1);
 
-                // write one block of content to the free block
-                write_blocks(j, 1, &content[i * BLOCKSIZE]);
+    // close every open file table entry of the file
+    for (int oft = 0; oft < NUMINODES; oft++)
+    {
+        if (openfiletable[oft].occupied == 1 && openfiletable[oft].inode == inodenumber)
+            openfiletable[oft].occupied = 0;
+    }
 
-                break;
+    // drop the references to the data blocks (modify the free byte map),
+    // blocks shared with clones stay; inline files have none
+    struct inode fileinode;
+    readinode(inodenumber, &fileinode);
+    for (int j = 0; j < 12 && !fileinode.inlined; j++)
+    {
+        if (fileinode.direct[j] != 0)
+            unrefblock(fileinode.direct[j]);
+    }
+    if (fileinode.indirect != 0 && !fileinode.inlined)
+    {
+        // the blocks behind a shared index block are still referenced by it
+        if (refcount(fileinode.indirect) == 1)
+        {
+            int indexblock[BLOCKSIZE / sizeof(int)];
+            read_blocks(fileinode.indirect, 1, indexblock);
+            for (int j = 0; j < BLOCKSIZE / sizeof(int); j++)
+            {
+                if (indexblock[j] != 0)
+                    unrefblock(indexblock[j]);
             }
         }
+        unrefblock(fileinode.indirect);
     }
 
-    // flush cache back to disk
-    write_blocks(1, 1, inodetablecache);
-    write_blocks(3, 1, freebytemapcache);
+    // remove from i-Node table
+    memset(&fileinode, 0, sizeof(fileinode));
+    writeinode(inodenumber, &fileinode);
+    if (inodenumber < inodehint)
+        inodehint = inodenumber;
+
+    // one entry less in the root directory
+    root.size--;
+    writeinode(0, &root);
 
-    return length;
+    // write modification back to disk
+    flushfreemap();
+    return 0;
 }
 
-int sfs_fread(int fileID, char *buffer, int length)
+/* makes dest a copy of source without copying data: the new i-Node points to
+ * the same data blocks (and index block), which are copied when either file
+ * writes to them. Returns 0, or -1 if source is missing or dest exists */
+int sfs_clone(char *source, char *dest)
 {
-    printf("\nREAD %d bytes FROM FILE %d\n", length, fileID);
-    int inodenumber = directorycache[fileID].inodenumber;
-    int rpointer; // read from the rwpointer
-    for (int i = 0; i < NUMDATABLOCKS; i++)
+    int index = lookup(source);
+    if (index == -1)
     {
-        if (openfiletable[i].inode == inodenumber)
-        {
-            rpointer = openfiletable[i].rwpointer;
-            // reading does not move the rwpointer
-            break;
-        }
+        printf("file %s not found\n", source);
+        return -1;
+    }
+    if (strlen(dest) > MAXFILENAME || lookup(dest) != -1)
+    {
+        printf("cannot create %s\n", dest);
+        return -1;
     }
 
-    int fileblocks = rpointer / BLOCKSIZE;   // number of full blocks
-    int address;                             // address of the first block to read
-    int indexblock[BLOCKSIZE / sizeof(int)]; // indirect index block
-    if (fileblocks < 12)
-        address = inodetablecache[inodenumber].direct[fileblocks];
-    else if (fileblocks == 12)
+    struct direntry entry;
+    struct inode node;
+    if (readdirentry(index, &entry) == -1 || readinode(entry.inodenumber, &node) == -1)
+        return -1;
+
+    // the blocks reachable from the i-Node get one more reference each
+    // (an inline file is copied with its i-Node)
+    int blocks[13], nblocks = 0;
+    for (int j = 0; j < 12 && !node.inlined; j++)
     {
-        // initialize the indirect index block
-        for (int i = 0; i < NUMDATABLOCKS; i++)
-        {
-            if (freebytemapcache[i] == 'E')
-                inodetablecache[inodenumber].indirect = i;
-            break;
-        }
-        address = indexblock[fileblocks - 12]; // indexblock[0]
+        if (node.direct[j] != 0)
+            blocks[nblocks++] = node.direct[j];
     }
-    else // fileblocks > 12
+    if (node.indirect != 0 && !node.inlined)
+        blocks[nblocks++] = node.indirect;
+    for (int j = 0; j < nblocks; j++)
     {
-        // access existing indirect index block
-        read_blocks(inodetablecache[inodenumber].indirect, 1, indexblock);
-        address = indexblock[fileblocks - 12];
+        if (refcount(blocks[j]) == MAXREFS)
+        {
+            printf("too many copies of %s\n", source);
+            return -1;
+        }
     }
 
-    int offset = rpointer % BLOCKSIZE; // offset within the first block to read
-    char buf[BLOCKSIZE];
-    read_blocks(address, 1, buf);
-    int bufferblocks = (length - (BLOCKSIZE - offset)) / BLOCKSIZE + 1; // number of blocks remaining (except the first block) to read
-    char *buf1 = &buf[offset];                                          // content of the first block to read from the r/w pointer
-    char result[length + 1];                                            // stores content read
+    int inodenumber;
+    if (createfile(dest, &node, &inodenumber) == -1)
+        return -1;
+    for (int j = 0; j < nblocks; j++)
+        setrefcount(blocks[j], refcount(blocks[j]) + 1);
+    flushfreemap();
+    return 0;
+}
 
-    strcpy(result, buf1);
+/* clones every file "name" into "name@tag", a point in time copy of the whole
+ * file system that only costs metadata. Files with an '@' in their name
+ * (earlier snapshots) are skipped. Returns the number of files copied, -1 if
+ * one of them could not be cloned */
+int sfs_snapshot(char *tag)
+{
+    struct direntry entry;
+    char names[NUMDIRENTRIES][MAXFILENAME + 1];
+    int nnames = 0;
 
-    for (int i = 0; i < bufferblocks; i++)
+    // list first: clones land in the directory being scanned
+    struct inode root;
+    readinode(0, &root);
+    for (int i = 0; i < root.size; i++)
     {
-        // find the address of next block to read from the i-Node
-        int address;
-        if (fileblocks + 1 + i < 12)
+        readdirentry(i, &entry);
+        if (strchr(entry.filename, '@') == NULL)
+            strcpy(names[nnames++], entry.filename);
+    }
+
+    char dest[MAXFILENAME + 2];
+    for (int i = 0; i < nnames; i++)
+    {
+        if (snprintf(dest, sizeof(dest), "%s@%s", names[i], tag) > MAXFILENAME)
         {
-            address = inodetablecache[inodenumber].direct[fileblocks + 1 + i];
-            if (address == 0) // pointer uninitialized
-                break;
+            printf("name too long: %s@%s\n", names[i], tag);
+            return -1;
         }
-        else
-            address = indexblock[fileblocks + 1 + i - 12];
-
-        // read a block to the buffer
-        char blockbuf[BLOCKSIZE];
-        read_blocks(address, 1, blockbuf);
+        if (sfs_clone(names[i], dest) == -1)
+            return -1;
     }
-    strcpy(buffer, result); // => segfault
+    return nnames;
+}
+
+/* fsck */
+
+// shared by the i-Node scanning threads of sfs_fsck
+struct fsckscan
+{
+    int repair;
+    const unsigned char *claimed; // i-Nodes used by a directory entry
+    int *expected;                // references found to each data block
+    unsigned char *seenindex;     // index blocks already counted
+    struct inode *fixed;          // repaired i-Nodes, to be written back
+    unsigned char *dirty;         // i-Nodes in fixed
+    int problems;
+    int unreadable;               // metadata blocks that could not be read
+};
 
-    return length;
+struct fsckrange
+{
+    struct fsckscan *scan;
+    int firstblock, nblocks; // part of the i-Node table
+};
+
+int validblock(int address)
+{
+    return address >= DATASTART && address < NUM_BLOCKS;
 }
 
-int sfs_fseek(int fileID, int loc)
+/* checks the pointers of one index block and counts its references, once
+ * per index block however many files share it */
+void fsckindex(struct fsckscan *scan, int inodenumber, int address)
 {
-    printf("\nSEEK TO LOCATION %d IN FILE %d\n", loc, fileID);
-    // find the i-Node number of the file
-    int inodenumber = directorycache[fileID].inodenumber;
-    int filesize = inodetablecache[inodenumber].size;
+    if (__atomic_exchange_n(&scan->seenindex[address - DATASTART], 1, __ATOMIC_RELAXED))
+        return;
 
-    if (loc >= filesize)
+    int indexblock[BLOCKSIZE / sizeof(int)], changed = 0;
+    if (read_blocks(address, 1, indexblock) < 0)
     {
-        printf("given location larger than file size: %d\n", filesize);
-        return -1;
+        printf("i-Node %d: index block %d unreadable\n", inodenumber, address);
+        __atomic_fetch_add(&scan->problems, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&scan->unreadable, 1, __ATOMIC_RELAXED);
+        return;
     }
-
-    // update r/w pointer in the open file table
-    for (int i = 0; i < NUMDATABLOCKS; i++)
+    for (int j = 0; j < BLOCKSIZE / sizeof(int); j++)
     {
-        if (openfiletable[i].inode == inodenumber)
+        if (indexblock[j] == 0)
+            continue;
+        if (!validblock(indexblock[j]))
         {
-            openfiletable[i].rwpointer = loc;
-            break;
+            printf("i-Node %d: index block %d points to block %d, outside the data area\n", inodenumber, address, indexblock[j]);
+            __atomic_fetch_add(&scan->problems, 1, __ATOMIC_RELAXED);
+            indexblock[j] = 0;
+            changed = 1;
+            continue;
         }
+        __atomic_fetch_add(&scan->expected[indexblock[j] - DATASTART], 1, __ATOMIC_RELAXED);
     }
-    return 0;
+    if (changed && scan->repair)
+        write_blocks(address, 1, indexblock);
 }
 
-int sfs_remove(char *file)
+/* scans a range of the i-Node table, read straight from the disk: the
+ * metadata cache is not shared between threads */
+void *fsckinodes(void *arg)
 {
-    for (int i = 0; i < NUMDATABLOCKS; i++)
+    struct fsckrange *range = (struct fsckrange *)arg;
+    struct fsckscan *scan = range->scan;
+    struct inode *table = (struct inode *)malloc(range->nblocks * BLOCKSIZE);
+    unsigned char *readable = (unsigned char *)malloc(range->nblocks);
+    memset(readable, 1, range->nblocks);
+    if (read_blocks(1 + range->firstblock, range->nblocks, table) < 0)
     {
-        struct inode fileinode;
-        // remove from directory
-        if (directorycache[i].filename == file)
+        // find the blocks that failed, the others are still checked
+        for (int b = 0; b < range->nblocks; b++)
         {
-            directorycache[i].occupied = 0;
+            if (read_blocks(1 + range->firstblock + b, 1, (char *)table + b * BLOCKSIZE) >= 0)
+                continue;
+            readable[b] = 0;
+            printf("i-Node table block %d: unreadable, i-Nodes %d-%d not checked\n", 1 + range->firstblock + b,
+                   (range->firstblock + b) * INODESPERBLOCK, (range->firstblock + b + 1) * INODESPERBLOCK - 1);
+            __atomic_fetch_add(&scan->problems, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&scan->unreadable, 1, __ATOMIC_RELAXED);
+        }
+    }
 
-            // remove from i-Node table
-            int inodenumber = directorycache[i].inodenumber;
-            fileinode = inodetablecache[inodenumber];
-            fileinode.occupied = 0;
+    for (int b = 0; b < range->nblocks; b++)
+    {
+        for (int k = 0; k < INODESPERBLOCK && readable[b]; k++)
+        {
+            int inodenumber = (range->firstblock + b) * INODESPERBLOCK + k;
+            struct inode node;
+            memcpy(&node, (char *)table + b * BLOCKSIZE + k * sizeof(struct inode), sizeof(node));
+            if (inodenumber == 0 || inodenumber >= NUMINODES || !scan->claimed[inodenumber])
+                continue;
 
-            // remove from the open file table
-            for (int j = 0; j < NUMDATABLOCKS; j++)
+            int bad = 0;
+            if (node.inlined)
             {
-                if (openfiletable[j].inode == inodenumber)
+                if (node.size < 0 || node.size > INLINESIZE)
                 {
-                    openfiletable[j].occupied = 0;
-                    break;
+                    printf("i-Node %d: inline size %d\n", inodenumber, node.size);
+                    node.size = node.size < 0 ? 0 : INLINESIZE;
+                    bad = 1;
                 }
             }
-            return 0;
+            else
+            {
+                for (int j = 0; j < 12; j++)
+                {
+                    if (node.direct[j] != 0 && !validblock(node.direct[j]))
+                    {
+                        printf("i-Node %d: block %d outside the data area\n", inodenumber, node.direct[j]);
+                        node.direct[j] = 0;
+                        bad = 1;
+                    }
+                    else if (node.direct[j] != 0)
+                        __atomic_fetch_add(&scan->expected[node.direct[j] - DATASTART], 1, __ATOMIC_RELAXED);
+                }
+                if (node.indirect != 0 && !validblock(node.indirect))
+                {
+                    printf("i-Node %d: index block %d outside the data area\n", inodenumber, node.indirect);
+                    node.indirect = 0;
+                    bad = 1;
+                }
+                else if (node.indirect != 0)
+                {
+                    __atomic_fetch_add(&scan->expected[node.indirect - DATASTART], 1, __ATOMIC_RELAXED);
+                    fsckindex(scan, inodenumber, node.indirect);
+                }
+            }
+            if (bad)
+            {
+                __atomic_fetch_add(&scan->problems, 1, __ATOMIC_RELAXED);
+                scan->fixed[inodenumber] = node;
+                scan->dirty[inodenumber] = 1;
+            }
         }
+    }
+    free(table);
+    free(readable);
+    return NULL;
+}
+
+/* checks the mounted file system, which must be idle: the directory against
+ * the i-Node table, then every block pointer, then the free byte map against
+ * the references found. With repair set, problems are fixed:
+ * - directory entries of free i-Nodes and duplicate names are dropped and
+ *   the directory is packed again, i-Nodes no entry uses are freed
+ * - pointers outside the data area are cleared
+ * - reference counts are set to the references found: leaked blocks become
+ *   free, blocks used twice but counted once become shared (copy on write)
+ * the i-Node table is scanned by up to nthreads threads.
+ * returns the number of problems found, -1 if no file system is mounted */
+int sfs_fsck(int repair, int nthreads)
+{
+    if (supercache.magic != MAGIC)
+    {
+        printf("no file system mounted\n");
+        return -1;
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > FSCKTHREADS)
+        nthreads = FSCKTHREADS;
 
-        // free the data blocks (modify the free byte map)
-        for (int j = 0; j < 12; j++)
+    struct fsckscan scan = {0};
+    scan.repair = repair;
+    unsigned char *claimed = (unsigned char *)calloc(NUMINODES, 1);
+    scan.claimed = claimed;
+    scan.expected = (int *)calloc(NUMDATABLOCKS, sizeof(int));
+    scan.seenindex = (unsigned char *)calloc(NUMDATABLOCKS, 1);
+    scan.fixed = (struct inode *)malloc(NUMINODES * sizeof(struct inode));
+    scan.dirty = (unsigned char *)calloc(NUMINODES, 1);
+
+    // directory: every entry in use must name an occupied i-Node that no
+    // other entry uses, and the used entries must be the first root.size
+    struct inode root, node;
+    struct direntry entry;
+    if (readinode(0, &root) == -1)
+    {
+        printf("root i-Node unreadable\n");
+        free(claimed);
+        free(scan.expected);
+        free(scan.seenindex);
+        free(scan.fixed);
+        free(scan.dirty);
+        return 1;
+    }
+    int *keep = (int *)malloc(NUMDIRENTRIES * sizeof(int));
+    int nkeep = 0, packed = 1;
+    int *names = (int *)malloc(2 * NUMDIRENTRIES * sizeof(int)); // hash set of kept entries
+    memset(names, -1, 2 * NUMDIRENTRIES * sizeof(int));
+    for (int i = 0; i < NUMDIRENTRIES; i++)
+    {
+        if (readdirentry(i, &entry) == -1)
         {
-            freebytemapcache[fileinode.direct[j]] = 'E';
+            if (i % DIRENTRIESPERBLOCK == 0) // once per block
+            {
+                printf("directory block %d: unreadable\n", DIRECTORYSTART + i / DIRENTRIESPERBLOCK);
+                scan.problems++;
+                scan.unreadable++;
+            }
+            continue;
         }
-        for (int j = 0; j < BLOCKSIZE / sizeof(int); j++)
+        if (entry.occupied != 1)
         {
-            int indexblock[BLOCKSIZE / sizeof(int)];
-            read_blocks(fileinode.indirect, 1, indexblock);
-            freebytemapcache[indexblock[j]] = 'E';
+            if (i < root.size)
+                packed = 0;
+            continue;
+        }
+        entry.filename[MAXFILENAME] = '\0';
+        if (entry.inodenumber <= 0 || entry.inodenumber >= NUMINODES)
+        {
+            printf("%s: i-Node %d out of range\n", entry.filename, entry.inodenumber);
+            scan.problems++;
+            continue;
         }
+        // an unreadable i-Node is reported by the table scan, the entry stays
+        if (readinode(entry.inodenumber, &node) == -1)
+            node.occupied = 1;
+        if (node.occupied != 1)
+        {
+            printf("%s: i-Node %d is free\n", entry.filename, entry.inodenumber);
+            scan.problems++;
+            continue;
+        }
+        unsigned int slot = 5381;
+        for (const char *c = entry.filename; *c; c++)
+            slot = slot * 33 + (unsigned char)*c;
+        struct direntry other;
+        for (slot %= 2 * NUMDIRENTRIES; names[slot] != -1; slot = (slot + 1) % (2 * NUMDIRENTRIES))
+        {
+            readdirentry(names[slot], &other);
+            if (strcmp(other.filename, entry.filename) == 0)
+                break;
+        }
+        if (claimed[entry.inodenumber] || names[slot] != -1)
+        {
+            printf("%s: i-Node %d or name already used by another entry\n", entry.filename, entry.inodenumber);
+            scan.problems++;
+            continue;
+        }
+        names[slot] = i;
+        claimed[entry.inodenumber] = 1;
+        if (i != nkeep)
+            packed = 0;
+        keep[nkeep++] = i;
+    }
+    if (!packed || nkeep != root.size)
+    {
+        printf("directory: %d files, root size %d, %spacked\n", nkeep, root.size, packed ? "" : "not ");
+        scan.problems++;
+    }
 
-        // write modification back to disk
-        write_blocks(1, 1, inodetablecache);
-        write_blocks(2, 1, directorycache);
-        write_blocks(3, 1, freebytemapcache);
+    // unreadable entries may hold files: the directory is not rewritten,
+    // and no i-Node is taken for an orphan
+    if (repair && scan.unreadable > 0)
+    {
+        printf("directory unreadable, not repairing\n");
+        repair = scan.repair = 0;
     }
 
-    // if no matching file with the given name
-    printf("file %s not found\n", file);
-    return -1;
-}
\ No newline at end of file
+    // i-Nodes in use that no directory entry reaches
+    for (int i = 1; i < NUMINODES; i++)
+    {
+        if (readinode(i, &node) == 0 && node.occupied != 0 && !claimed[i])
+        {
+            printf("i-Node %d: not in the directory\n", i);
+            scan.problems++;
+            if (repair)
+            {
+                memset(&node, 0, sizeof(node));
+                writeinode(i, &node);
+                if (i < inodehint)
+                    inodehint = i;
+            }
+        }
+    }
+
+    if (repair && (!packed || nkeep != root.size || scan.problems > 0))
+    {
+        // rewrite the directory with the good entries only, packed
+        for (int i = 0; i < nkeep; i++)
+        {
+            readdirentry(keep[i], &entry);
+            if (keep[i] != i)
+                writedirentry(i, &entry);
+        }
+        memset(&entry, 0, sizeof(entry));
+        for (int i = nkeep; i < NUMDIRENTRIES; i++)
+        {
+            struct direntry old;
+            readdirentry(i, &old);
+            if (old.occupied != 0)
+                writedirentry(i, &entry);
+        }
+        root.size = nkeep;
+        writeinode(0, &root);
+        memset(namecache, 0, sizeof(namecache));
+    }
+    free(keep);
+    free(names);
+
+    // block pointers, the i-Node table split between the threads
+    pthread_t threads[FSCKTHREADS];
+    struct fsckrange ranges[FSCKTHREADS];
+    int per = (INODETABLELENGTH + nthreads - 1) / nthreads;
+    int started = 0;
+    for (int t = 0; t < nthreads && t * per < INODETABLELENGTH; t++)
+    {
+        ranges[t].scan = &scan;
+        ranges[t].firstblock = t * per;
+        ranges[t].nblocks = INODETABLELENGTH - t * per < per ? INODETABLELENGTH - t * per : per;
+        if (pthread_create(&threads[t], NULL, fsckinodes, &ranges[t]) != 0)
+        {
+            fsckinodes(&ranges[t]); // no thread: scan this range here
+            continue;
+        }
+        started |= 1 << t;
+    }
+    for (int t = 0; t < nthreads; t++)
+    {
+        if (started & (1 << t))
+            pthread_join(threads[t], NULL);
+    }
+    for (int i = 0; repair && i < NUMINODES; i++)
+    {
+        if (scan.dirty[i])
+            writeinode(i, &scan.fixed[i]);
+    }
+
+    // free byte map against the references found; with unreadable i-Nodes or
+    // index blocks the references are incomplete, so the map is left alone
+    for (int j = 0; j < NUMDATABLOCKS && scan.unreadable == 0; j++)
+    {
+        int found = scan.expected[j];
+        if (found == refcountcache[j])
+            continue;
+        if (found == 0)
+            printf("block %d: leaked, count %d but not used\n", DATASTART + j, refcountcache[j]);
+        else
+            printf("block %d: used %d times, counted %d\n", DATASTART + j, found, refcountcache[j]);
+        scan.problems++;
+        if (repair)
+            setrefcount(DATASTART + j, found < MAXREFS ? found : MAXREFS);
+    }
+    if (repair)
+        flushfreemap();
+
+    free(claimed);
+    free(scan.expected);
+    free(scan.seenindex);
+    free(scan.fixed);
+    free(scan.dirty);
+    return scan.problems;
+}
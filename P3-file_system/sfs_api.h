@@ -1,12 +1,32 @@
 #ifndef SFS_API_H
 #define SFS_API_H
 
+#include <pthread.h>
+
 // You can add more into this file.
 
 void mksfs(int);
 
 int sfs_getnextfilename(char*);
 
+// directory listing: each caller keeps its own cursor
+#define SFS_MAXFILENAME 32
+
+struct sfs_dir
+{
+    int position; // next directory entry
+};
+
+struct sfs_dirent
+{
+    char name[SFS_MAXFILENAME + 1];
+    int size; // bytes
+};
+
+void sfs_opendir(struct sfs_dir*);
+
+int sfs_readdir(struct sfs_dir*, struct sfs_dirent*, int);
+
 int sfs_getfilesize(const char*);
 
 int sfs_fopen(char*);
@@ -21,4 +41,14 @@ int sfs_fseek(int, int);
 
 int sfs_remove(char*);
 
+int sfs_clone(char*, char*);
+
+int sfs_snapshot(char*);
+
+int sfs_fsck(int, int);
+
+// for callers that serialize sfs_* calls with a lock of their own: sfs_fread
+// and sfs_fwrite release it while they wait for data blocks
+void sfs_setlock(pthread_mutex_t*);
+
 #endif
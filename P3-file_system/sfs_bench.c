@@ -0,0 +1,425 @@
+/* sfs_bench.c
+ *
+ * Benchmark and stress harness for the simple file system.
+ * Runs fio-like workloads (and file cloning) against sfs_api and reports throughput, IOPS,
+ * latency percentiles and the number of read_blocks/write_blocks calls
+ * issued per operation (I/O amplification).
+ *
+ * usage: ./sfs_bench [ops per workload] [random seed] [disk profile] [codec]
+ * disk profile: none (default), hdd, ssd, hdd-deadline (see disk_emu.c);
+ * dev(us)/op is the device time modeled by disk_emu per operation.
+ * codec: none (default), crc, lz, lz+crc; B/blkB is the bytes moved to and
+ * from the media per byte of the blocks transferred (1.00 without a codec).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+#define MAXFILESIZE (1024 * 128) // keep files within direct + indirect reach
+#define NUMSMALLFILES 64         // files created by the create/delete storm
+#define NUMLISTFILES 200         // directory size for the listing workload
+#define NAMELEN (SFS_MAXFILENAME + 1)
+#define BLOCKSIZE 1024           // sfs_api block size
+
+int iosizes[] = {64, 256, 1024, 4096};
+#define NUMIOSIZES (int)(sizeof(iosizes) / sizeof(iosizes[0]))
+
+int nops = 200; // operations per workload
+
+// private generator: mksfs reseeds rand() from the clock (init_fresh_disk),
+// so the seed argument would not make the runs reproducible
+unsigned int seed = 1;
+
+int benchrand()
+{
+    return rand_r(&seed);
+}
+
+/* per workload measurements */
+struct result
+{
+    const char *name;
+    int iosize;       // bytes per operation, 0 for metadata workloads
+    int ops;          // operations completed
+    double seconds;   // total time spent inside sfs_* calls
+    double *latency;  // per operation latency in microseconds
+    struct disk_stats io;
+};
+
+int stdoutfd = -1; // saved stdout while sfs_* trace output is silenced
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// sfs_api prints a trace line for every call; send it to /dev/null while timing
+void quiet()
+{
+    fflush(stdout);
+    stdoutfd = dup(1);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, 1);
+    close(devnull);
+}
+
+void loud()
+{
+    fflush(stdout);
+    dup2(stdoutfd, 1);
+    close(stdoutfd);
+}
+
+void result_init(struct result *res, const char *name, int iosize, int ops)
+{
+    memset(res, 0, sizeof(*res));
+    res->name = name;
+    res->iosize = iosize;
+    res->latency = (double *)malloc(sizeof(double) * ops);
+    disk_reset_stats();
+}
+
+// snapshot the block I/O issued since result_init()
+void result_done(struct result *res)
+{
+    disk_get_stats(&res->io);
+}
+
+// time one operation: call between start = now() and the end of the op
+void result_add(struct result *res, double start)
+{
+    double elapsed = now() - start;
+    res->latency[res->ops++] = elapsed * 1e6;
+    res->seconds += elapsed;
+}
+
+int cmpdouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+double percentile(double *sorted, int n, double pct)
+{
+    if (n == 0)
+        return 0;
+    int i = (int)(pct / 100.0 * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+void print_header()
+{
+    printf("%-12s %6s %6s %9s %10s %9s %9s %9s %9s %8s %8s %11s %7s\n",
+           "workload", "iosize", "ops", "MB/s", "IOPS",
+           "p50(us)", "p95(us)", "p99(us)", "max(us)", "rd/op", "wr/op", "dev(us)/op", "B/blkB");
+}
+
+void print_result(struct result *res)
+{
+    qsort(res->latency, res->ops, sizeof(double), cmpdouble);
+
+    double mbps = 0, iops = 0;
+    if (res->seconds > 0)
+    {
+        mbps = (double)res->iosize * res->ops / res->seconds / (1024 * 1024);
+        iops = res->ops / res->seconds;
+    }
+    double ops = res->ops > 0 ? res->ops : 1;
+    double blocks = res->io.blocks_read + res->io.blocks_written;
+    double moved = blocks > 0 ? (res->io.bytes_read + res->io.bytes_written) / (blocks * BLOCKSIZE) : 0;
+
+    printf("%-12s %6d %6d %9.2f %10.0f %9.1f %9.1f %9.1f %9.1f %8.2f %8.2f %11.1f %7.2f\n",
+           res->name, res->iosize, res->ops, mbps, iops,
+           percentile(res->latency, res->ops, 50),
+           percentile(res->latency, res->ops, 95),
+           percentile(res->latency, res->ops, 99),
+           percentile(res->latency, res->ops, 100),
+           res->io.read_calls / ops, res->io.write_calls / ops, res->io.busy_us / ops, moved);
+    free(res->latency);
+}
+
+// fill a buffer with printable, non-zero bytes (sfs_api treats data as strings)
+void fill(char *buf, int size)
+{
+    for (int i = 0; i < size - 1; i++)
+        buf[i] = 'a' + benchrand() % 26;
+    buf[size - 1] = '\0';
+}
+
+// fill a buffer with log-like lines: compressible, unlike fill()
+void filltext(char *buf, int size)
+{
+    static const char *levels[] = {"INFO", "WARN", "DEBUG"};
+    static const char *events[] = {"request served", "cache miss", "connection closed", "retrying"};
+    int n = 0;
+    while (n < size - 1)
+        n += snprintf(buf + n, size - n, "2024-05-01 12:%02d:%02d %s worker-%d %s\n", benchrand() % 60,
+                      benchrand() % 60, levels[benchrand() % 3], benchrand() % 8, events[benchrand() % 4]);
+    buf[size - 1] = '\0';
+}
+
+void bench_sequential(int iosize, const char *wrname, const char *rdname, void (*fillbuf)(char *, int))
+{
+    static char name[] = "seq.dat";
+    char *buf = (char *)malloc(iosize + 1024);
+    int ops = MAXFILESIZE / iosize < nops ? MAXFILESIZE / iosize : nops;
+    struct result wr, rd;
+
+    quiet();
+    mksfs(1);
+    int f = sfs_fopen(name);
+    fillbuf(buf, iosize);
+
+    result_init(&wr, wrname, iosize, ops);
+    for (int i = 0; i < ops; i++)
+    {
+        double start = now();
+        sfs_fwrite(f, buf, iosize);
+        result_add(&wr, start);
+    }
+    result_done(&wr);
+
+    result_init(&rd, rdname, iosize, ops);
+    for (int i = 0; i < ops; i++)
+    {
+        double start = now();
+        sfs_fseek(f, i * iosize);
+        sfs_fread(f, buf, iosize);
+        result_add(&rd, start);
+    }
+    result_done(&rd);
+    sfs_fclose(f);
+    loud();
+
+    print_result(&wr);
+    print_result(&rd);
+    free(buf);
+}
+
+void bench_random(int iosize)
+{
+    static char name[] = "rand.dat";
+    char *buf = (char *)malloc(iosize + 1024);
+    int nchunks = MAXFILESIZE / iosize < nops ? MAXFILESIZE / iosize : nops;
+    struct result wr, rd;
+
+    // lay the file out first so that random offsets hit existing data
+    quiet();
+    mksfs(1);
+    int f = sfs_fopen(name);
+    fill(buf, iosize);
+    for (int i = 0; i < nchunks; i++)
+        sfs_fwrite(f, buf, iosize);
+
+    result_init(&rd, "randread", iosize, nops);
+    for (int i = 0; i < nops; i++)
+    {
+        int loc = (benchrand() % nchunks) * iosize;
+        double start = now();
+        sfs_fseek(f, loc);
+        sfs_fread(f, buf, iosize);
+        result_add(&rd, start);
+    }
+    result_done(&rd);
+
+    result_init(&wr, "randwrite", iosize, nops);
+    for (int i = 0; i < nops; i++)
+    {
+        int loc = (benchrand() % nchunks) * iosize;
+        double start = now();
+        sfs_fseek(f, loc);
+        sfs_fwrite(f, buf, iosize);
+        result_add(&wr, start);
+    }
+    result_done(&wr);
+    sfs_fclose(f);
+    loud();
+
+    print_result(&rd);
+    print_result(&wr);
+    free(buf);
+}
+
+// add the block I/O issued between two counter snapshots to a result
+void add_io(struct result *res, struct disk_stats *before, struct disk_stats *after)
+{
+    res->io.read_calls += after->read_calls - before->read_calls;
+    res->io.write_calls += after->write_calls - before->write_calls;
+    res->io.blocks_read += after->blocks_read - before->blocks_read;
+    res->io.blocks_written += after->blocks_written - before->blocks_written;
+    res->io.bytes_read += after->bytes_read - before->bytes_read;
+    res->io.bytes_written += after->bytes_written - before->bytes_written;
+    res->io.busy_us += after->busy_us - before->busy_us;
+}
+
+void bench_createdelete()
+{
+    static char names[NUMSMALLFILES][NAMELEN];
+    char buf[128];
+    int rounds = nops / NUMSMALLFILES > 0 ? nops / NUMSMALLFILES : 1;
+    struct result cr, rm;
+    struct disk_stats before, after;
+
+    for (int i = 0; i < NUMSMALLFILES; i++)
+        sprintf(names[i], "small%d.cfg", i);
+    fill(buf, sizeof(buf));
+
+    quiet();
+    mksfs(1);
+    result_init(&cr, "create", sizeof(buf), rounds * NUMSMALLFILES);
+    result_init(&rm, "delete", 0, rounds * NUMSMALLFILES);
+    for (int r = 0; r < rounds; r++)
+    {
+        disk_get_stats(&before);
+        for (int i = 0; i < NUMSMALLFILES; i++)
+        {
+            double start = now();
+            int f = sfs_fopen(names[i]);
+            sfs_fwrite(f, buf, sizeof(buf));
+            sfs_fclose(f);
+            result_add(&cr, start);
+        }
+        disk_get_stats(&after);
+        add_io(&cr, &before, &after);
+
+        for (int i = 0; i < NUMSMALLFILES; i++)
+        {
+            double start = now();
+            sfs_remove(names[i]);
+            result_add(&rm, start);
+        }
+        disk_get_stats(&before);
+        add_io(&rm, &after, &before);
+    }
+    loud();
+
+    print_result(&cr);
+    print_result(&rm);
+}
+
+void bench_listing()
+{
+    static char names[NUMLISTFILES][NAMELEN];
+    char fname[NAMELEN];
+    int passes = nops / 10 > 0 ? nops / 10 : 1;
+    struct result ls;
+
+    quiet();
+    mksfs(1);
+    for (int i = 0; i < NUMLISTFILES; i++)
+    {
+        sprintf(names[i], "log%04d.txt", i);
+        sfs_fclose(sfs_fopen(names[i]));
+    }
+
+    result_init(&ls, "readdir", 0, passes * (NUMLISTFILES + 1));
+    for (int p = 0; p < passes; p++)
+    {
+        int more;
+        do
+        {
+            double start = now();
+            more = sfs_getnextfilename(fname);
+            result_add(&ls, start);
+        } while (more == 0 && ls.ops < passes * (NUMLISTFILES + 1));
+    }
+    result_done(&ls);
+
+    // the same listing with a cursor, 64 entries (names and sizes) per call
+    struct sfs_dirent entries[64];
+    struct sfs_dir dir;
+    struct result batch;
+    int calls = passes * (NUMLISTFILES / 64 + 2);
+    result_init(&batch, "readdir64", 0, calls);
+    for (int p = 0; p < passes; p++)
+    {
+        int n;
+        sfs_opendir(&dir);
+        do
+        {
+            double start = now();
+            n = sfs_readdir(&dir, entries, 64);
+            result_add(&batch, start);
+        } while (n > 0 && batch.ops < calls);
+    }
+    result_done(&batch);
+    loud();
+
+    print_result(&ls);
+    print_result(&batch);
+}
+
+// clone a full size file, then overwrite one block of the clone (copy on write)
+void bench_clone()
+{
+    static char name[] = "base.img", copy[] = "copy.img";
+    char *buf = (char *)malloc(MAXFILESIZE);
+    struct result cl, cw;
+    struct disk_stats before, after;
+
+    quiet();
+    mksfs(1);
+    int f = sfs_fopen(name);
+    fill(buf, MAXFILESIZE);
+    sfs_fwrite(f, buf, MAXFILESIZE);
+    sfs_fclose(f);
+
+    result_init(&cl, "clone", 0, nops);
+    result_init(&cw, "cowwrite", 1024, nops);
+    for (int i = 0; i < nops; i++)
+    {
+        disk_get_stats(&before);
+        double start = now();
+        sfs_clone(name, copy);
+        result_add(&cl, start);
+        disk_get_stats(&after);
+        add_io(&cl, &before, &after);
+
+        f = sfs_fopen(copy);
+        start = now();
+        sfs_fseek(f, (benchrand() % (MAXFILESIZE / 1024)) * 1024);
+        sfs_fwrite(f, buf, 1024);
+        result_add(&cw, start);
+        disk_get_stats(&before);
+        add_io(&cw, &after, &before);
+        sfs_fclose(f);
+        sfs_remove(copy);
+    }
+    loud();
+
+    print_result(&cl);
+    print_result(&cw);
+    free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        nops = atoi(argv[1]);
+    seed = argc > 2 ? atoi(argv[2]) : 1;
+    if (nops <= 0 || (argc > 3 && disk_set_profile(argv[3]) == -1) || (argc > 4 && disk_set_codec(argv[4]) == -1))
+    {
+        printf("usage: %s [ops per workload] [random seed] [none|hdd|ssd|hdd-deadline] [none|crc|lz|lz+crc]\n",
+               argv[0]);
+        return 1;
+    }
+
+    print_header();
+    for (int i = 0; i < NUMIOSIZES; i++)
+        bench_sequential(iosizes[i], "seqwrite", "seqread", fill);
+    bench_sequential(4096, "logwrite", "logread", filltext);
+    for (int i = 0; i < NUMIOSIZES; i++)
+        bench_random(iosizes[i]);
+    bench_createdelete();
+    bench_listing();
+    bench_clone();
+    return 0;
+}
@@ -0,0 +1,45 @@
+/* sfs_fsck.c
+ *
+ * Checks (and with -r repairs) the simple file system stored in "disk":
+ * directory, i-Nodes, index blocks and the free byte map.
+ *
+ * usage: ./sfs_fsck [-r] [-c codec] [threads]
+ * codec: the disk_emu codec the image was written with (none, crc, lz, lz+crc)
+ * exit status: 0 clean, 1 problems found (fixed with -r), 2 no file system
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+#include "disk_emu.h"
+
+int main(int argc, char *argv[])
+{
+    int repair = 0, threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 1;
+    if (i < argc && strcmp(argv[i], "-r") == 0)
+    {
+        repair = 1;
+        i++;
+    }
+    if (i + 1 < argc && strcmp(argv[i], "-c") == 0)
+    {
+        if (disk_set_codec(argv[i + 1]) == -1)
+            return 2;
+        i += 2;
+    }
+    if (i < argc)
+        threads = atoi(argv[i]);
+
+    mksfs(0);
+    int problems = sfs_fsck(repair, threads);
+    if (problems == -1)
+        return 2;
+    if (problems == 0)
+        printf("clean\n");
+    else
+        printf("%d problem%s %s\n", problems, problems > 1 ? "s" : "", repair ? "repaired" : "found, run with -r to repair");
+    return problems > 0;
+}